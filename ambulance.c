@@ -3,14 +3,60 @@
 #include <string.h>
 #include <math.h>
 #include <time.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <errno.h>
+#include <strings.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-#define MAX_LOCATIONS 10
-#define MAX_AMBULANCES 5
-#define MAX_EMERGENCIES 20
-#define MAX_HOSPITALS 5
+#define DEFAULT_AMBULANCES 5
+#define DIST_MATRIX_MAX_LOCATIONS 2048
+#define ARENA_BLOCK_SIZE 65536
 #define MIN_SERVICE_TIME 3
 #define MAX_SERVICE_TIME 8
 #define REASSIGN_THRESHOLD 5
+#define WAIT_TIME_WEIGHT 1
+#define BATCH_MAX_SIZE 128
+#define BATCH_PRIORITY_WEIGHT 10
+#define RESPONSE_HIST_SIZE 240
+#define HIST_SUB_BUCKETS 16
+#define SPATIAL_CANDIDATES 8
+#define ALT_LANDMARKS 8
+#define CH_WITNESS_SETTLE 64
+#define CH_FILE_MAGIC "AMBDCH01"
+#define CH_FILE_VERSION 1
+#define TRAFFIC_BUCKET_MINUTES 15
+#define TRAFFIC_BUCKETS (24 * 60 / TRAFFIC_BUCKET_MINUTES)
+#define TRAFFIC_MAX_PROFILES 8
+#define TRAFFIC_MAX_POINTS 24
+#define ACTIVE_PAGE_SIZE 256
+#define SNAPSHOT_MAGIC "AMBDSN01"
+#define SNAPSHOT_VERSION 2
+#define HTTP_DEFAULT_PORT 3000
+#define HTTP_MAX_REQUEST 65536
+#define HTTP_MAX_EVENTS 64
+#define HTTP_MAX_BACKLOG (4 << 20)
+#define LOG_RING_SIZE 16384
+#define LOG_ARG_BYTES 180
+#define JOURNAL_MAGIC "AMBDJN01"
+#define JOURNAL_VERSION 1
+#define JOURNAL_BUFFER_SIZE 65536
+#define JOURNAL_CALLER_SIZE ((int)sizeof(((Emergency*)0)->caller))
+#define HIST_BUCKETS (HIST_SUB_BUCKETS * 41)
 
 //Enums
 typedef enum { 
@@ -21,6 +67,22 @@ typedef enum {
     CARDIAC = 5 
 } DiseaseType;
 
+typedef enum {
+    LOG_ERROR,
+    LOG_WARN,
+    LOG_INFO,
+    LOG_DEBUG
+} LogLevel;
+
+// How point-to-point routes are searched on maps too large for the
+// distance matrix; all of them give the same distances
+typedef enum {
+    ROUTE_DIJKSTRA,
+    ROUTE_ASTAR,
+    ROUTE_ALT,
+    ROUTE_CH
+} RoutingMode;
+
 typedef enum { 
     IDLE,
     TO_EMERGENCY,
@@ -55,649 +117,6332 @@ typedef struct {
     int serviceTime;
 } Emergency;
 
+// Per-unit fields the fleet scans touch (state, location, availableAt)
+// live in SimContext as parallel arrays; see //Fleet Scans.
 typedef struct {
     int id;
-    AmbulanceState state;
-    int location;
-    int availableAt;
     int targetEmergency;
     int targetHospital;
     int estimatedArrival;
     int baseHospital;
+    int timerVersion;
+    // Minute the current leg set off, or -1 while no open road reaches
+    // its destination and the unit waits where it is
+    int legStart;
 } Ambulance;
 
 typedef struct Road {
     int destination;
     int distance;
+    int profile;
+    int closed;
     struct Road* next;
 } Road;
 
+typedef struct {
+    int points;
+    int minute[TRAFFIC_MAX_POINTS];
+    int percent[TRAFFIC_MAX_POINTS];
+} TrafficProfile;
 
 
-Location locations[MAX_LOCATIONS];
-Hospital hospitals[MAX_HOSPITALS];
-Ambulance ambulances[MAX_AMBULANCES];
-Emergency activeEmergencies[MAX_EMERGENCIES];
-Emergency pendingQueue[MAX_EMERGENCIES];
-
-Road* roads[MAX_LOCATIONS];
 
-int currentTime = 0;
+//Memory Arena
 
-int hospitalCount = 0;
-int activeCount = 0;
-int queueSize = 0;
-int nextEmergencyId = 0;
-int totalHandled = 0;
-int totalResponseTime = 0;
+// Bump allocator for objects that live until the map is torn down (road
+// edges). Blocks are chained and released together by arenaReset.
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t used;
+    size_t size;
+    _Alignas(16) char data[];
+} ArenaBlock;
 
+typedef struct {
+    ArenaBlock* head;
+} Arena;
 
-//Map Setup
+void* arenaAlloc(Arena* arena, size_t bytes) {
+    bytes = (bytes + 15) & ~(size_t)15;
+    
+    if(arena->head == NULL || arena->head->used + bytes > arena->head->size) {
+        size_t size = bytes > ARENA_BLOCK_SIZE ? bytes : ARENA_BLOCK_SIZE;
+        ArenaBlock* block = malloc(sizeof(ArenaBlock) + size);
+        if(!block) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        block->next = arena->head;
+        block->used = 0;
+        block->size = size;
+        arena->head = block;
+    }
+    
+    void* p = arena->head->data + arena->head->used;
+    arena->head->used += bytes;
+    return p;
+}
 
-void setupLocations() {
-    strcpy(locations[0].name, "City Center"); locations[0].x = 0; locations[0].y = 0;
-    strcpy(locations[1].name, "Main Street"); locations[1].x = 4; locations[1].y = 0;
-    strcpy(locations[2].name, "Park Avenue"); locations[2].x = 10; locations[2].y = 0;
-    strcpy(locations[3].name, "Shopping Mall"); locations[3].x = 15; locations[3].y = 0;
-    strcpy(locations[4].name, "University"); locations[4].x = 18; locations[4].y = 0;
-    strcpy(locations[5].name, "Airport"); locations[5].x = 25; locations[5].y = 0;
-    strcpy(locations[6].name, "North Market"); locations[6].x = 0; locations[6].y = 8;
-    strcpy(locations[7].name, "Residential"); locations[7].x = 4; locations[7].y = 8;
-    strcpy(locations[8].name, "Industrial Zone"); locations[8].x = 30; locations[8].y = 0;
-    strcpy(locations[9].name, "Tech Park"); locations[9].x = 33; locations[9].y = 0;
+void arenaReset(Arena* arena) {
+    while(arena->head) {
+        ArenaBlock* next = arena->head->next;
+        free(arena->head);
+        arena->head = next;
+    }
 }
 
-void addRoad(int from, int to, int distance) {
-    Road* r1 = malloc(sizeof(Road));
-    r1->destination = to; r1->distance = distance;
-    r1->next = roads[from]; roads[from] = r1;
+// Makes room for at least `needed` elements, growing geometrically so
+// appends stay amortised O(1). Returns the (possibly moved) array.
+void* reserveArray(void* array, int* capacity, int needed, size_t elemSize) {
+    if(needed <= *capacity) return array;
+    
+    int newCap = *capacity ? *capacity : 8;
+    while(newCap < needed) newCap *= 2;
     
-    Road* r2 = malloc(sizeof(Road));
-    r2->destination = from; r2->distance = distance;
-    r2->next = roads[to]; roads[to] = r2;
+    void* grown = realloc(array, (size_t)newCap * elemSize);
+    if(!grown) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    *capacity = newCap;
+    return grown;
 }
 
-void setupRoads() {
-    for(int i = 0; i < MAX_LOCATIONS; i++) roads[i] = NULL;
-    addRoad(0,1,4); addRoad(1,2,6); addRoad(2,3,5);
-    addRoad(3,4,3); addRoad(4,5,7); addRoad(1,5,10);
-    addRoad(0,6,8); addRoad(6,7,4); addRoad(7,3,6);
-    addRoad(5,8,5); addRoad(8,9,3);
-}
 
-void addHospital(const char* name, int loc, int cap, DiseaseType spec) {
-    strcpy(hospitals[hospitalCount].name, name);
-    hospitals[hospitalCount].location = loc;
-    hospitals[hospitalCount].capacity = cap;
-    hospitals[hospitalCount].patients = 0;
-    hospitals[hospitalCount].specialty = spec;
-    hospitalCount++;
-}
+//Id Map
 
-void setupHospitals() {
-    addHospital("City General", 0, 10, GENERAL);
-    addHospital("Heart Center", 5, 5, CARDIAC);
-    addHospital("Trauma Unit", 9, 8, TRAUMA);
-    addHospital("Children's Hospital", 6, 6, RESPIRATORY);
+// Open-addressing hash map from emergency id to a slot index. Linear
+// probing, power-of-two table kept at most half full, backward-shift
+// deletion so no tombstones build up.
+typedef struct {
+    int* keys;
+    int* values;
+    int cap;
+    int count;
+} IdMap;
+
+unsigned idMapHash(int key, int cap) {
+    unsigned h = (unsigned)key * 0x9E3779B1u;
+    return (h ^ (h >> 16)) & (unsigned)(cap - 1);
 }
 
-void setupAmbulances() {
-    for(int i = 0; i < MAX_AMBULANCES; i++) {
-        ambulances[i].id = i + 1;
-        ambulances[i].state = IDLE;
-        ambulances[i].availableAt = 0;
-        ambulances[i].targetEmergency = -1;
-        ambulances[i].targetHospital = -1;
+void idMapPut(IdMap* m, int key, int value);
+
+void idMapGrow(IdMap* m) {
+    int oldCap = m->cap;
+    int* oldKeys = m->keys;
+    int* oldValues = m->values;
+    
+    m->cap = oldCap ? oldCap * 2 : 16;
+    m->keys = malloc(m->cap * sizeof(int));
+    m->values = malloc(m->cap * sizeof(int));
+    if(!m->keys || !m->values) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
     }
-    ambulances[0].location = 1;
-    ambulances[0].baseHospital = 0;
-    ambulances[1].location = 4;
-    ambulances[1].baseHospital = 0;
-    ambulances[2].location = 7;
-    ambulances[2].baseHospital = 0;
+    for(int i = 0; i < m->cap; i++) m->keys[i] = -1;
+    m->count = 0;
+    
+    for(int i = 0; i < oldCap; i++)
+        if(oldKeys[i] != -1) idMapPut(m, oldKeys[i], oldValues[i]);
+    free(oldKeys);
+    free(oldValues);
 }
 
+int idMapGet(IdMap* m, int key) {
+    if(m->cap == 0) return -1;
+    for(unsigned i = idMapHash(key, m->cap); ; i = (i + 1) & (m->cap - 1)) {
+        if(m->keys[i] == key) return m->values[i];
+        if(m->keys[i] == -1) return -1;
+    }
+}
 
-//Shortest Route Calculation
-
-int findShortestPath(int from, int to) {
-    int distance[MAX_LOCATIONS];
-    int visited[MAX_LOCATIONS] = {0};
+void idMapPut(IdMap* m, int key, int value) {
+    if(2 * (m->count + 1) > m->cap) idMapGrow(m);
     
-    for(int i = 0; i < MAX_LOCATIONS; i++)
-        distance[i] = 99999;
-    distance[from] = 0;
+    unsigned i = idMapHash(key, m->cap);
+    while(m->keys[i] != -1 && m->keys[i] != key)
+        i = (i + 1) & (m->cap - 1);
+    if(m->keys[i] == -1) m->count++;
+    m->keys[i] = key;
+    m->values[i] = value;
+}
+
+void idMapRemove(IdMap* m, int key) {
+    if(m->cap == 0) return;
+    unsigned mask = m->cap - 1;
+    unsigned i = idMapHash(key, m->cap);
+    while(m->keys[i] != key) {
+        if(m->keys[i] == -1) return;
+        i = (i + 1) & mask;
+    }
     
-    for(int count = 0; count < MAX_LOCATIONS; count++) {
-        int minDist = 99999, closest = -1;
-        for(int i = 0; i < MAX_LOCATIONS; i++) {
-            if(!visited[i] && distance[i] < minDist) {
-                minDist = distance[i];
-                closest = i;
-            }
-        }
-        if(closest == -1) break;
-        visited[closest] = 1;
-        
-        for(Road* r = roads[closest]; r != NULL; r = r->next) {
-            int newDist = distance[closest] + r->distance;
-            if(newDist < distance[r->destination])
-                distance[r->destination] = newDist;
+    // Shift later members of the probe run back into the hole
+    unsigned j = i;
+    while(1) {
+        j = (j + 1) & mask;
+        if(m->keys[j] == -1) break;
+        unsigned home = idMapHash(m->keys[j], m->cap);
+        if(((j - home) & mask) >= ((j - i) & mask)) {
+            m->keys[i] = m->keys[j];
+            m->values[i] = m->values[j];
+            i = j;
         }
     }
-    return distance[to];
+    m->keys[i] = -1;
+    m->count--;
 }
 
+void idMapClear(IdMap* m) {
+    for(int i = 0; i < m->cap; i++) m->keys[i] = -1;
+    m->count = 0;
+}
 
-//Priority Calculation & Best Hospital selection
+// Pending calls: records sit in stable slots, the heap orders small
+// (key, id, slot) entries and pendingPos maps a slot back to its heap index.
+//
+// Aging: a call's effective priority is
+//     priority + WAIT_TIME_WEIGHT * (currentTime - reportTime)
+// Every call ages at the same rate, so the order between two calls never
+// changes as time passes. The heap therefore stores the time-independent
+// key  priority - WAIT_TIME_WEIGHT * reportTime  and never needs a rebuild.
+typedef struct {
+    int key;
+    int id;
+    int slot;
+} QueueKey;
 
-int calculatePriority(DiseaseType disease, int age) {
-    int priority = disease * 3;
-    if(disease == CARDIAC && age >= 60) priority += 3;
-    if(disease == RESPIRATORY && (age <= 10 || age >= 60)) priority += 2;
-    return priority;
-}
+typedef struct {
+    int dist;
+    int node;
+} HeapNode;
 
-int getDynamicServiceTime(DiseaseType disease, int age) {
-    int baseTime = MIN_SERVICE_TIME + (rand() % (MAX_SERVICE_TIME - MIN_SERVICE_TIME + 1));
+// Binary min-heap of HeapNodes on dist, for the graph searches
+typedef struct {
+    HeapNode* items;
+    int size, cap;
+} NodeHeap;
+
+typedef struct {
+    int time;
+    int ambulance;
+    int version;
+} TimerEvent;
+
+// One journaled event. arg holds, by type:
+//   ADVANCE   minutes                      (console or scenario input)
+//   CALL      id, location, disease, age, service minutes (+ caller name)
+//   CLOSE     from, to                     REOPEN  from, to
+//   BATCH     on
+//   DISPATCH  unit, call, hospital, ETA
+//   REQUEUE   call                         (no hospital bed free)
+//   ARRIVE    unit, call, service minutes
+//   TRANSPORT unit, hospital, ETA
+//   DELIVER   unit, call, minutes back to base
+//   IDLE      unit
+//   REASSIGN  call, old unit, new unit, ETA
+//   DISCHARGE hospital
+typedef enum {
+    JOURNAL_ADVANCE = 1,
+    JOURNAL_CALL,
+    JOURNAL_CLOSE,
+    JOURNAL_REOPEN,
+    JOURNAL_BATCH,
+    JOURNAL_DISPATCH,
+    JOURNAL_REQUEUE,
+    JOURNAL_ARRIVE,
+    JOURNAL_TRANSPORT,
+    JOURNAL_DELIVER,
+    JOURNAL_IDLE,
+    JOURNAL_REASSIGN,
+    JOURNAL_DISCHARGE
+} JournalType;
+
+typedef struct {
+    int type;
+    int time;
+    int arg[5];
+} JournalRecord;
+
+typedef struct {
+    char magic[8];
+    int version;
+    int recordSize;
+    int startTime;
+    int nextEmergencyId;
+    int batchDispatch;
+    int reserved;
+    unsigned long long rngState;
+} JournalHeader;
+
+typedef struct {
+    FILE* file;
+    char* buffer;
+    int used;
+    // Replay: the mapped journal a run is checked against, record by
+    // record, instead of being written
+    const char* replay;
+    size_t replaySize;
+    size_t replayPos;
+    long replayChecked;
+    int replayDiverged;
+} Journal;
+
+typedef struct {
+    int* items;
+    int count, cap;
+    IdMap seen;
+} ChangeSet;
+
+// Working arrays for batch dispatch rounds, grown as needed and kept
+// from one round to the next
+typedef struct {
+    int* frontier;
+    int* heapIdx;
+    int* unitIdx;
+    int* dist;
+    long* cost;
+    int* rowMatch;
+    int* unitForCall;
+    Emergency* chosen;
+    char* taken;
+    // Hungarian solver: potentials, matching and per-column state
+    long* rowPotential;
+    long* colPotential;
+    int* colMatch;
+    int* way;
+    long* minv;
+    char* used;
+    int frontierCap, heapIdxCap, unitIdxCap, distCap, costCap, rowMatchCap;
+    int unitForCallCap, chosenCap, takenCap, rowPotentialCap, colPotentialCap;
+    int colMatchCap, wayCap, minvCap, usedCap;
+} BatchScratch;
+
+// Uniform grid over the map's bounding box. Items (unit or hospital
+// indices) are chained per cell through next/prev, so a unit changes
+// cell in O(1) when it moves.
+typedef struct {
+    int minX, minY;
+    int cellSize;
+    int cols, rows;
+    int* head;
+    int* next;
+    int* prev;
+    int* cell;
+} SpatialGrid;
+
+
+//Instrumentation
+
+// Log-linear histogram in the HDR style: values below HIST_SUB_BUCKETS
+// get a bucket each, every power of two above that is split into
+// HIST_SUB_BUCKETS equal buckets, so any recorded value is known to
+// within about 6% at a fixed 5 KB per histogram.
+typedef struct {
+    long count;
+    long sum;
+    long min;
+    long max;
+    long buckets[HIST_BUCKETS];
+} Histogram;
+
+int histBucket(long value) {
+    if(value < HIST_SUB_BUCKETS) return value < 0 ? 0 : (int)value;
     
-    if(disease == TRAUMA) baseTime += 2;
-    if(disease == CARDIAC && age >= 60) baseTime += 1;
-    if(age >= 80) baseTime += 1;
+    int magnitude = 63 - __builtin_clzll((unsigned long long)value);
+    int shift = magnitude - 4;
+    int bucket = (magnitude - 3) * HIST_SUB_BUCKETS + (int)(value >> shift) - HIST_SUB_BUCKETS;
+    return bucket < HIST_BUCKETS ? bucket : HIST_BUCKETS - 1;
+}
+
+// Largest value that lands in `bucket`
+long histBucketTop(int bucket) {
+    if(bucket < HIST_SUB_BUCKETS) return bucket;
     
-    return baseTime;
+    int shift = bucket / HIST_SUB_BUCKETS - 1;
+    long base = (long)(HIST_SUB_BUCKETS + bucket % HIST_SUB_BUCKETS) << shift;
+    return base + (1L << shift) - 1;
 }
 
-int findBestHospital(int emergencyLoc, DiseaseType disease) {
-    int best = -1, bestScore = 99999;
+void histRecord(Histogram* h, long value) {
+    if(h->count == 0 || value < h->min) h->min = value;
+    if(value > h->max) h->max = value;
+    h->count++;
+    h->sum += value;
+    h->buckets[histBucket(value)]++;
+}
+
+long histPercentile(const Histogram* h, double fraction) {
+    if(h->count == 0) return 0;
     
-    for(int i = 0; i < hospitalCount; i++) {
-        if(hospitals[i].patients >= hospitals[i].capacity) continue;
-        
-        int distance = findShortestPath(emergencyLoc, hospitals[i].location);
-        int score = distance * 10;
-        if(hospitals[i].specialty == disease) score -= 50;
-        
-        if(score < bestScore) {
-            bestScore = score;
-            best = i;
+    long target = (long)ceil(h->count * fraction);
+    if(target < 1) target = 1;
+    long seen = 0;
+    for(int b = 0; b < HIST_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if(seen >= target) {
+            long top = histBucketTop(b);
+            return top < h->max ? top : h->max;
         }
     }
-    return best;
+    return h->max;
 }
 
+// Counters and distributions for the dispatch hot paths. Recording is
+// a few adds; only searches that actually run (not matrix lookups) and
+// dispatch rounds are timed.
+typedef struct {
+    long shortestPathCalls;
+    long shortestPathSearches;
+    long shortestPathSettled;
+    long distanceMatrixBuilds;
+    long distanceRowRepairs;
+    long nearestUnitSearches;
+    long dispatches;
+    long requeues;
+    long reassignments;
+    long reassignMinutesSaved;
+    
+    Histogram searchNanos;
+    Histogram dispatchNanos;
+    Histogram queueWaitMinutes;
+    // Call to unit on scene, indexed by DiseaseType
+    Histogram responseByDisease[CARDIAC + 1];
+} SimStats;
 
-//Priority Queue (Max-Heap)
 
+//Simulation Context
+
+// Everything one simulation run owns. Each thread works on its own
+// context through `sim`, so independent runs can share a process.
+typedef struct {
+    Location* locations;
+    Hospital* hospitals;
+    Ambulance* ambulances;
+    unsigned char* unitState;
+    int* unitLocation;
+    int* unitAvailableAt;
+    int* idleUnits;
+    int locationCount, locationCap;
+    int hospitalCount, hospitalCap;
+    int ambulanceCount, ambulanceCap;
+    
+    // Calls with a unit assigned (see //Active Emergencies)
+    Emergency** activePages;
+    int activePageCount;
+    int* activeList;
+    int* activePos;
+    int* freeActiveSlots;
+    int freeActiveCount;
+    int activeSlotCount;
+    int activeCount, activeCap;
+    IdMap activeIndex;
+    
+    Emergency* pendingRecords;
+    QueueKey* pendingHeap;
+    int* pendingPos;
+    int* freePendingSlots;
+    int freePendingCount;
+    int pendingSlotCount;
+    int queueSize, queueCap;
+    IdMap pendingIndex;
+    
+    Road** roads;
+    Arena roadArena;
+    int* csrOffset;
+    int* csrTarget;
+    int* csrWeight;
+    int* csrProfile;
+    int roadCount;
+    int closedRoads;
+    int csrValid;
+    // Road graph restored from a snapshot: csrTarget/Weight/Profile point
+    // into the mapped file until something reshapes the graph, and the
+    // road lists are only built from it once something needs them
+    void* graphMap;
+    size_t graphMapSize;
+    int mappedNodes;
+    const int* mappedRoadDistance;
+    const unsigned char* mappedRoadClosed;
+    int roadListsPending;
+    
+    int* distMatrix;
+    int distMatrixStride;
+    int distMatrixValid;
+    // Rows a road closure may have lengthened, recomputed on next use
+    unsigned char* distRowStale;
+    
+    // Time-of-day traffic (see //Traffic Profiles). With traffic on,
+    // small maps cache one row of travel times per source, stamped
+    // with the bucket it was computed for.
+    TrafficProfile trafficProfiles[TRAFFIC_MAX_PROFILES];
+    short trafficPercent[TRAFFIC_MAX_PROFILES][TRAFFIC_BUCKETS];
+    int trafficEnabled;
+    int* trafficRows;
+    int* trafficRowBucket;
+    int trafficRowsValid;
+    
+    // Route minutes are never below minutesPerUnit times the straight
+    // line between two locations (set by buildRoadGraph)
+    double minutesPerUnit;
+    
+    RoutingMode routing;
+    int* landmarkDist;
+    int landmarkCount;
+    int landmarksValid;
+    
+    // Contraction hierarchy: node ranks and each node's edges to
+    // higher-ranked nodes, roads and shortcuts together
+    int* chRank;
+    int* chUpOffset;
+    int* chUpTarget;
+    int* chUpWeight;
+    int chUpCount;
+    int chValid;
+    const char* chFile;
+    // Backward half of the bidirectional query, 99999 between queries
+    int* chBackDist;
+    int* chBackTouched;
+    int chBackTouchedCount;
+    NodeHeap chBackHeap;
+    
+    SpatialGrid unitGrid;
+    SpatialGrid hospitalGrid;
+    int* spatialCandidates;
+    int spatialValid;
+    
+    // Per-query scratch space, sized to locationCount. Entries sit at
+    // 99999 / -1 between queries; scratchTouched lists what a query wrote
+    int* scratchDist;
+    int* scratchOwner;
+    int* scratchTouched;
+    int scratchTouchedCount;
+    NodeHeap pathHeap;
+    
+    TimerEvent* timerHeap;
+    int timerCount, timerCap;
+    // Unit whose transition is being handled right now, or INT_MAX
+    // outside updateAmbulanceStates. Units after it may still fire
+    // this minute.
+    int timerCursor;
+    
+    int currentTime;
+    int idleAmbulances;
+    int nextEmergencyId;
+    int totalHandled;
+    int totalResponseTime;
+    
+    // Minutes from call to unit on scene, one bucket per minute; the
+    // last bucket collects everything longer
+    int responseMinutes[RESPONSE_HIST_SIZE];
+    SimStats stats;
+    // Clock reads for the latency histograms; off in Monte Carlo runs,
+    // which only report simulated minutes
+    int statsTiming;
+    
+    // Batch dispatch: assign all waiting calls to idle units each minute.
+    // The greedy/optimal totals compare the two on the same snapshots.
+    int batchDispatch;
+    long batchOptimalMinutes;
+    long batchGreedyMinutes;
+    int batchRounds;
+    BatchScratch batch;
+    
+    // Scenario calls and closures fed in so far, so a run restored from
+    // a snapshot picks up the scenario where it was taken
+    int fedCalls;
+    int fedClosures;
+    
+    Journal journal;
+    
+    // Per-tick change sets for pushed deltas (see //Change Tracking)
+    int trackChanges;
+    ChangeSet changedUnits;
+    ChangeSet changedHospitals;
+    ChangeSet changedEmergencies;
+    
+    // Event messages from the simulation; switched off in headless runs
+    int simLogEnabled;
+    
+    unsigned long long rngState;
+} SimContext;
+
+_Thread_local SimContext* sim = NULL;
+
+// Routing for newly created contexts (--routing, --ch-file)
+RoutingMode defaultRouting = ROUTE_ASTAR;
+const char* defaultChFile = NULL;
 
-void heapSwap(Emergency* a, Emergency* b) {
-    Emergency temp = *a;
-    *a = *b;
-    *b = temp;
+int parseRouting(const char* word) {
+    const char* names[] = { "dijkstra", "astar", "alt", "ch" };
+    for(int i = 0; i < 4; i++)
+        if(strcmp(word, names[i]) == 0) return i;
+    return -1;
 }
 
-void enqueueEmergency(const char* caller, int loc, DiseaseType disease, int age) {
-    Emergency e;
-    e.id = nextEmergencyId++;
-    strcpy(e.caller, caller);
-    e.location = loc;
-    e.disease = disease;
-    e.age = age;
-    e.priority = calculatePriority(disease, age);
-    e.assignedAmbulance = -1;
-    e.canReassign = 1;
-    e.reportTime = currentTime;
-    e.serviceTime = getDynamicServiceTime(disease, age);
-    
-    pendingQueue[queueSize] = e;
-    int i = queueSize++;
-    
-    while(i > 0 && pendingQueue[(i-1)/2].priority < pendingQueue[i].priority) {
-        heapSwap(&pendingQueue[i], &pendingQueue[(i-1)/2]);
-        i = (i-1)/2;
+SimContext* createSimContext(unsigned long long seed) {
+    SimContext* ctx = calloc(1, sizeof(SimContext));
+    if(!ctx) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
     }
+    ctx->timerCursor = INT_MAX;
+    ctx->simLogEnabled = 1;
+    ctx->statsTiming = 1;
+    ctx->routing = defaultRouting;
+    ctx->chFile = defaultChFile;
+    ctx->rngState = seed;
+    return ctx;
 }
 
-Emergency dequeueEmergency() {
-    Emergency top = pendingQueue[0];
-    pendingQueue[0] = pendingQueue[--queueSize];
-    
-    int i = 0;
-    while(1) {
-        int left = 2*i + 1;
-        int right = 2*i + 2;
-        int largest = i;
-        
-        if(left < queueSize && pendingQueue[left].priority > pendingQueue[largest].priority)
-            largest = left;
-        if(right < queueSize && pendingQueue[right].priority > pendingQueue[largest].priority)
-            largest = right;
-        
-        if(largest == i) break;
-        heapSwap(&pendingQueue[i], &pendingQueue[largest]);
-        i = largest;
+void freeSpatialGrid(SpatialGrid* g) {
+    free(g->head);
+    free(g->next);
+    free(g->prev);
+    free(g->cell);
+    memset(g, 0, sizeof(*g));
+}
+
+void freeChanges(ChangeSet* set) {
+    free(set->items);
+    free(set->seen.keys);
+    free(set->seen.values);
+}
+
+void freeBatchScratch(BatchScratch* b) {
+    free(b->frontier);
+    free(b->heapIdx);
+    free(b->unitIdx);
+    free(b->dist);
+    free(b->cost);
+    free(b->rowMatch);
+    free(b->unitForCall);
+    free(b->chosen);
+    free(b->taken);
+    free(b->rowPotential);
+    free(b->colPotential);
+    free(b->colMatch);
+    free(b->way);
+    free(b->minv);
+    free(b->used);
+}
+
+void destroySimContext(SimContext* ctx) {
+    free(ctx->locations);
+    free(ctx->hospitals);
+    free(ctx->ambulances);
+    free(ctx->unitState);
+    free(ctx->unitLocation);
+    free(ctx->unitAvailableAt);
+    free(ctx->idleUnits);
+    for(int i = 0; i < ctx->activePageCount; i++) free(ctx->activePages[i]);
+    free(ctx->activePages);
+    free(ctx->activeList);
+    free(ctx->activePos);
+    free(ctx->freeActiveSlots);
+    free(ctx->activeIndex.keys);
+    free(ctx->activeIndex.values);
+    free(ctx->pendingRecords);
+    free(ctx->pendingHeap);
+    free(ctx->pendingPos);
+    free(ctx->freePendingSlots);
+    free(ctx->pendingIndex.keys);
+    free(ctx->pendingIndex.values);
+    free(ctx->journal.buffer);
+    freeChanges(&ctx->changedUnits);
+    freeChanges(&ctx->changedHospitals);
+    freeChanges(&ctx->changedEmergencies);
+    freeBatchScratch(&ctx->batch);
+    free(ctx->roads);
+    arenaReset(&ctx->roadArena);
+    free(ctx->csrOffset);
+    if(ctx->graphMap) munmap(ctx->graphMap, ctx->graphMapSize);
+    else {
+        free(ctx->csrTarget);
+        free(ctx->csrWeight);
+        free(ctx->csrProfile);
     }
+    free(ctx->trafficRows);
+    free(ctx->trafficRowBucket);
+    free(ctx->distMatrix);
+    free(ctx->distRowStale);
+    free(ctx->landmarkDist);
+    free(ctx->chRank);
+    free(ctx->chUpOffset);
+    free(ctx->chUpTarget);
+    free(ctx->chUpWeight);
+    free(ctx->chBackDist);
+    free(ctx->chBackTouched);
+    free(ctx->chBackHeap.items);
+    free(ctx->scratchDist);
+    free(ctx->scratchOwner);
+    free(ctx->scratchTouched);
+    freeSpatialGrid(&ctx->unitGrid);
+    freeSpatialGrid(&ctx->hospitalGrid);
+    free(ctx->spatialCandidates);
+    free(ctx->pathHeap.items);
+    free(ctx->timerHeap);
+    free(ctx);
+}
+
+// splitmix64: every context draws from its own stream, so a run is
+// reproducible from its seed whatever other threads are doing
+unsigned simRandom() {
+    unsigned long long z = (sim->rngState += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return (unsigned)((z ^ (z >> 31)) >> 32);
+}
+
+// Start of a timed section, or 0 when timing is off
+long monotonicNanos() {
+    if(!sim->statsTiming) return 0;
     
-    return top;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
 }
 
+void recordElapsed(Histogram* h, long start) {
+    if(sim->statsTiming) histRecord(h, monotonicNanos() - start);
+}
 
-//Ambulance State Tracking 
 
+//Logging
 
-int findNearestIdleAmbulance(int emergencyLoc) {
-    int best = -1, shortestDist = 99999;
-    
-    for(int i = 0; i < MAX_AMBULANCES; i++) {
-        if(ambulances[i].state == IDLE) {
-            int dist = findShortestPath(ambulances[i].location, emergencyLoc);
-            if(dist < shortestDist) {
-                shortestDist = dist;
-                best = i;
-            }
-        }
-    }
-    return best;
+// Simulation messages go through a bounded lock-free ring to a writer
+// thread. The simulation thread only copies the format pointer and the
+// raw arguments into a slot; formatting and stdout happen on the writer.
+// Producers claim slots with a CAS on head (Vyukov's bounded queue), so
+// several simulation threads may log at once. When the ring is full the
+// message is dropped and counted rather than waited for.
+typedef struct {
+    atomic_uint sequence;
+    const char* format;
+    int argBytes;
+    char args[LOG_ARG_BYTES];
+} LogRecord;
+
+typedef struct {
+    LogRecord ring[LOG_RING_SIZE];
+    atomic_uint head;
+    atomic_uint tail;
+    atomic_long dropped;
+    atomic_int running;
+    int started;
+    pthread_t thread;
+} Logger;
+
+Logger logger;
+LogLevel logLevel = LOG_INFO;
+
+int parseLogLevel(const char* word) {
+    const char* names[] = { "error", "warn", "info", "debug" };
+    for(int i = 0; i < 4; i++)
+        if(strcmp(word, names[i]) == 0) return i;
+    return -1;
 }
 
-Emergency* findActiveEmergency(int emergencyId) {
-    for(int i = 0; i < activeCount; i++) {
-        if(activeEmergencies[i].id == emergencyId)
-            return &activeEmergencies[i];
+// Conversion character ending the format spec that starts at p (just
+// after '%'); sets *isLong for an 'l' length modifier. Formats may use
+// d i u x c s f g e and %%.
+const char* logSpecEnd(const char* p, int* isLong) {
+    *isLong = 0;
+    while(*p && strchr("-+ #0123456789.", *p)) p++;
+    while(*p == 'l') {
+        *isLong = 1;
+        p++;
     }
-    return NULL;
+    return p;
 }
 
-void dispatchAmbulance(int ambIndex, Emergency emerg);
-void checkReassignmentOpportunities();
-
-void updateAmbulanceStates() {
-    for(int i = 0; i < MAX_AMBULANCES; i++) {
-        if(ambulances[i].state == IDLE) continue;
-        
-        if(currentTime >= ambulances[i].availableAt) {
-            if(ambulances[i].state == TO_EMERGENCY) {
-                ambulances[i].state = AT_SCENE;
-                
-                Emergency* e = findActiveEmergency(ambulances[i].targetEmergency);
-                if(e) {
-                    ambulances[i].location = e->location;
-                    ambulances[i].availableAt = currentTime + e->serviceTime;
-                    e->canReassign = 0;
-                    printf("  [Time %d] Unit-%d arrived at scene (service time: %d min)\n", 
-                           currentTime, ambulances[i].id, e->serviceTime);
-                }
-            }
-            else if(ambulances[i].state == AT_SCENE) {
-                ambulances[i].state = TO_HOSPITAL;
-                int dist = findShortestPath(ambulances[i].location, 
-                                           hospitals[ambulances[i].targetHospital].location);
-                ambulances[i].availableAt = currentTime + dist;
-                printf("  [Time %d] Unit-%d transporting to %s (ETA: %d min)\n", 
-                       currentTime, ambulances[i].id, 
-                       hospitals[ambulances[i].targetHospital].name, dist);
+// Copies the arguments fmt names into out, in order, and returns the
+// bytes used. Once one does not fit, it and the rest are left out.
+int logPack(char* out, const char* fmt, va_list args) {
+    int used = 0, full = 0;
+    for(const char* p = fmt; *p; p++) {
+        if(*p != '%') continue;
+        int isLong;
+        p = logSpecEnd(p + 1, &isLong);
+        if(!*p) break;
+        
+        if(*p == 's') {
+            const char* s = va_arg(args, const char*);
+            int len = strlen(s);
+            if(full || used + len + 1 > LOG_ARG_BYTES) full = 1;
+            else {
+                memcpy(out + used, s, len + 1);
+                used += len + 1;
             }
-            else if(ambulances[i].state == TO_HOSPITAL) {
-                ambulances[i].state = RETURNING;
-                ambulances[i].location = hospitals[ambulances[i].targetHospital].location;
-                
-                for(int j = 0; j < activeCount; j++) {
-                    if(activeEmergencies[j].id == ambulances[i].targetEmergency) {
-                        activeEmergencies[j] = activeEmergencies[--activeCount];
-                        totalHandled++;
-                        break;
-                    }
-                }
-                
-                int returnDist = findShortestPath(ambulances[i].location, 
-                                                  hospitals[ambulances[i].baseHospital].location);
-                ambulances[i].availableAt = currentTime + returnDist;
-                
-                printf("  [Time %d] Unit-%d delivered patient, returning to base (%d min)\n", 
-                       currentTime, ambulances[i].id, returnDist);
-                
-                ambulances[i].targetEmergency = -1;
-                ambulances[i].targetHospital = -1;
+        }
+        else if(strchr("diuxc", *p)) {
+            long v = isLong ? va_arg(args, long) : va_arg(args, int);
+            if(full || used + (int)sizeof(long) > LOG_ARG_BYTES) full = 1;
+            else {
+                memcpy(out + used, &v, sizeof(long));
+                used += sizeof(long);
             }
-            else if(ambulances[i].state == RETURNING) {
-                ambulances[i].state = IDLE;
-                ambulances[i].location = hospitals[ambulances[i].baseHospital].location;
-                printf("  [Time %d] Unit-%d back at base and available\n", 
-                       currentTime, ambulances[i].id);
-                
-                checkReassignmentOpportunities();
+        }
+        else if(strchr("fge", *p)) {
+            double v = va_arg(args, double);
+            if(full || used + (int)sizeof(double) > LOG_ARG_BYTES) full = 1;
+            else {
+                memcpy(out + used, &v, sizeof(double));
+                used += sizeof(double);
             }
         }
     }
+    return used;
 }
 
-
-//Dynamic Reassignment
-
-void checkReassignmentOpportunities() {
-    for(int i = 0; i < activeCount; i++) {
-        Emergency* e = &activeEmergencies[i];
-        
-        if(!e->canReassign || e->assignedAmbulance == -1)
+// Formats a packed record into line[size]; arguments that were left
+// out print as nothing
+void logFormat(char* line, int size, const char* fmt, const char* args, int argBytes) {
+    int len = 0, used = 0;
+    for(const char* p = fmt; *p && len < size - 1; p++) {
+        if(*p != '%') {
+            line[len++] = *p;
             continue;
+        }
+        int isLong;
+        const char* start = p;
+        p = logSpecEnd(p + 1, &isLong);
+        if(!*p) break;
+        if(*p == '%') {
+            line[len++] = '%';
+            continue;
+        }
         
-        int currentAmb = e->assignedAmbulance;
-        int currentETA = ambulances[currentAmb].estimatedArrival;
-        
-        int nearestAmb = findNearestIdleAmbulance(e->location);
+        // The spec without its length modifier; integers are packed as long
+        char spec[24];
+        int specLen = 0;
+        for(const char* q = start; q < p && specLen < 20; q++)
+            if(*q != 'l') spec[specLen++] = *q;
+        if(strchr("diux", *p)) spec[specLen++] = 'l';
+        spec[specLen++] = *p;
+        spec[specLen] = '\0';
         
-        if(nearestAmb != -1 && nearestAmb != currentAmb) {
-            int newDist = findShortestPath(ambulances[nearestAmb].location, e->location);
-            int newETA = currentTime + newDist;
-            
-            if(currentETA - newETA >= REASSIGN_THRESHOLD) {
-                printf("\n  [REASSIGNMENT] Emergency #%d\n", e->id);
-                printf("     Old: Unit-%d (ETA %d) -> New: Unit-%d (ETA %d)\n",
-                       currentAmb + 1, currentETA - currentTime,
-                       nearestAmb + 1, newDist);
-                printf("     Time saved: %d minutes\n", currentETA - newETA);
-                
-                ambulances[currentAmb].state = IDLE;
-                ambulances[currentAmb].targetEmergency = -1;
-                
-                dispatchAmbulance(nearestAmb, *e);
-                return;
+        int n = 0;
+        if(*p == 's') {
+            if(used < argBytes) {
+                n = snprintf(line + len, size - len, spec, args + used);
+                used += strlen(args + used) + 1;
+            }
+        }
+        else if(strchr("diuxc", *p)) {
+            long v;
+            if(used + (int)sizeof(long) <= argBytes) {
+                memcpy(&v, args + used, sizeof(long));
+                used += sizeof(long);
+                if(*p == 'c') n = snprintf(line + len, size - len, spec, (int)v);
+                else if(*p == 'u' || *p == 'x') n = snprintf(line + len, size - len, spec, (unsigned long)v);
+                else n = snprintf(line + len, size - len, spec, v);
             }
         }
+        else if(strchr("fge", *p)) {
+            double v;
+            if(used + (int)sizeof(double) <= argBytes) {
+                memcpy(&v, args + used, sizeof(double));
+                used += sizeof(double);
+                n = snprintf(line + len, size - len, spec, v);
+            }
+        }
+        if(n > 0) len += n < size - len ? n : size - len - 1;
     }
+    line[len] = '\0';
 }
 
-void dispatchAmbulance(int ambIndex, Emergency emerg) {
-    int hospIndex = findBestHospital(emerg.location, emerg.disease);
+// Formats and writes every record published so far; returns how many
+int logDrain() {
+    static char line[4096];
+    int count = 0;
+    unsigned pos = atomic_load_explicit(&logger.tail, memory_order_relaxed);
     
-    if(hospIndex == -1) {
-        enqueueEmergency(emerg.caller, emerg.location, emerg.disease, emerg.age);
-        printf("  [WARNING] No hospital available, emergency re-queued\n");
-        return;
+    while(1) {
+        LogRecord* r = &logger.ring[pos & (LOG_RING_SIZE - 1)];
+        if(atomic_load_explicit(&r->sequence, memory_order_acquire) != pos + 1) break;
+        
+        logFormat(line, sizeof(line), r->format, r->args, r->argBytes);
+        fputs(line, stdout);
+        atomic_store_explicit(&r->sequence, pos + LOG_RING_SIZE, memory_order_release);
+        atomic_store_explicit(&logger.tail, ++pos, memory_order_release);
+        count++;
     }
     
-    int distToScene = findShortestPath(ambulances[ambIndex].location, emerg.location);
-    
-    ambulances[ambIndex].state = TO_EMERGENCY;
-    ambulances[ambIndex].targetEmergency = emerg.id;
-    ambulances[ambIndex].targetHospital = hospIndex;
-    ambulances[ambIndex].availableAt = currentTime + distToScene;
-    ambulances[ambIndex].estimatedArrival = currentTime + distToScene;
-    
-    emerg.assignedAmbulance = ambIndex;
-    emerg.canReassign = 1;
-    activeEmergencies[activeCount++] = emerg;
-    
-    hospitals[hospIndex].patients++;
-    
-    totalResponseTime += distToScene;
-    
-    printf("\n  [DISPATCH] Unit-%d dispatched to %s\n", ambIndex + 1, emerg.caller);
-    printf("  Location: %s\n", locations[emerg.location].name);
-    printf("  Destination: %s\n", hospitals[hospIndex].name);
-    printf("  ETA: %d minutes\n", distToScene);
+    long dropped = atomic_exchange(&logger.dropped, 0);
+    if(dropped > 0) fprintf(stdout, "  [LOG] %ld messages dropped\n", dropped);
+    return count;
 }
 
-void processQueue() {
-    if(queueSize == 0) return;
-    
-    int ambIndex = findNearestIdleAmbulance(pendingQueue[0].location);
-    if(ambIndex != -1) {
-        Emergency e = dequeueEmergency();
-        dispatchAmbulance(ambIndex, e);
+// Writer thread: drains the ring, backing off (up to 5 ms) while idle
+void* logWriter(void* arg) {
+    (void)arg;
+    long idleNanos = 50000;
+    while(1) {
+        if(logDrain() > 0) {
+            idleNanos = 50000;
+            continue;
+        }
+        if(!atomic_load(&logger.running)) break;
+        fflush(stdout);
+        
+        struct timespec ts = { 0, idleNanos };
+        nanosleep(&ts, NULL);
+        if(idleNanos < 5000000) idleNanos *= 2;
     }
+    logDrain();
+    fflush(stdout);
+    return NULL;
 }
 
-void advanceTime(int minutes) {
-    for(int i = 0; i < minutes; i++) {
-        currentTime++;
-        updateAmbulanceStates();
-        processQueue();
-        
-        if(currentTime % 15 == 0) {
-            for(int j = 0; j < hospitalCount; j++) {
-                if(hospitals[j].patients > 0) {
-                    hospitals[j].patients--;
-                    printf("  [Time %d] Patient discharged from %s\n", 
-                           currentTime, hospitals[j].name);
-                }
-            }
-        }
+// Waits until everything logged so far is written, so direct output that
+// follows (menus, summaries) comes after it
+void logFlush() {
+    if(!logger.started) return;
+    while(atomic_load_explicit(&logger.tail, memory_order_acquire) !=
+          atomic_load_explicit(&logger.head, memory_order_acquire)) {
+        struct timespec ts = { 0, 20000 };
+        nanosleep(&ts, NULL);
     }
 }
 
+void logStop() {
+    if(!logger.started) return;
+    atomic_store(&logger.running, 0);
+    pthread_join(logger.thread, NULL);
+    logger.started = 0;
+}
 
-//User Interface
+// Starts the writer thread; until then (and if it cannot start) messages
+// are written directly. Pending messages are written out at exit.
+void logStart() {
+    if(logger.started) return;
+    for(unsigned i = 0; i < LOG_RING_SIZE; i++) atomic_init(&logger.ring[i].sequence, i);
+    atomic_store(&logger.head, 0);
+    atomic_store(&logger.tail, 0);
+    atomic_store(&logger.running, 1);
+    if(pthread_create(&logger.thread, NULL, logWriter, NULL) != 0) return;
+    logger.started = 1;
+    atexit(logStop);
+}
 
-const char* getStateName(AmbulanceState state) {
-    switch(state) {
-        case IDLE: return "Available";
-        case TO_EMERGENCY: return "Going to scene";
-        case AT_SCENE: return "On scene";
-        case TO_HOSPITAL: return "To hospital";
-        case RETURNING: return "Returning to base";
-        default: return "Unknown";
+void simLog(LogLevel level, const char* fmt, ...) {
+    if(!sim->simLogEnabled || level > logLevel) return;
+    va_list args;
+    va_start(args, fmt);
+    if(!logger.started) {
+        vprintf(fmt, args);
+        va_end(args);
+        return;
+    }
+    
+    unsigned pos = atomic_load_explicit(&logger.head, memory_order_relaxed);
+    LogRecord* r;
+    while(1) {
+        r = &logger.ring[pos & (LOG_RING_SIZE - 1)];
+        int diff = (int)(atomic_load_explicit(&r->sequence, memory_order_acquire) - pos);
+        if(diff == 0) {
+            if(atomic_compare_exchange_weak_explicit(&logger.head, &pos, pos + 1,
+                                                     memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if(diff < 0) {
+            atomic_fetch_add(&logger.dropped, 1);
+            va_end(args);
+            return;
+        }
+        else pos = atomic_load_explicit(&logger.head, memory_order_relaxed);
     }
+    
+    r->format = fmt;
+    r->argBytes = logPack(r->args, fmt, args);
+    va_end(args);
+    atomic_store_explicit(&r->sequence, pos + 1, memory_order_release);
 }
 
-void viewAmbulanceStatus() {
-    printf("\nAMBULANCE FLEET STATUS\n");
-    printf("\n\n");
+
+//Event Journal
+
+// Append-only binary log of every input and state transition of a run.
+// Records collect in a buffer that goes to disk, with one fsync, when it
+// fills and at commit points (after each console command, at the end of
+// a run). The journal starts from the state the run had when it was
+// opened or last checkpointed; replaying it from that state re-creates
+// the run, RNG draws included, and checks each record on the way.
+int journalRecordSize(int type) {
+    return sizeof(JournalRecord) + (type == JOURNAL_CALL ? JOURNAL_CALLER_SIZE : 0);
+}
+
+void journalWriteHeader() {
+    Journal* j = &sim->journal;
+    JournalHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+    header.version = JOURNAL_VERSION;
+    header.recordSize = sizeof(JournalRecord);
+    header.startTime = sim->currentTime;
+    header.nextEmergencyId = sim->nextEmergencyId;
+    header.batchDispatch = sim->batchDispatch;
+    header.rngState = sim->rngState;
+    fwrite(&header, sizeof(header), 1, j->file);
+}
+
+void journalClose();
+
+// Writes out the buffered records and syncs them to disk
+void journalFlush() {
+    Journal* j = &sim->journal;
+    if(!j->file) return;
     
-    for(int i = 0; i < MAX_AMBULANCES; i++) {
-        printf("  Unit-%d: %s", i + 1, getStateName(ambulances[i].state));
-        
-        if(ambulances[i].state == IDLE)
-            printf(" at %s", locations[ambulances[i].location].name);
-        else
-            printf(" (free in %d min)", ambulances[i].availableAt - currentTime);
-        
-        printf("\n");
+    int ok = j->used == 0 || fwrite(j->buffer, 1, j->used, j->file) == (size_t)j->used;
+    j->used = 0;
+    if(!ok || fflush(j->file) != 0 || fsync(fileno(j->file)) != 0) {
+        fprintf(stderr, "Journal write failed, journaling stopped\n");
+        fclose(j->file);
+        j->file = NULL;
     }
-    printf("\n");
 }
 
-void makeEmergencyCall() {
-    char* operators[] = {"Sarah", "Mike", "Priya", "David", "Lisa"};
-    char* op = operators[rand() % 5];
-    
-    printf("\n\nEmergency 108 - Dispatch\n\n");
-    
-    char name[50];
+int journalOpen(const char* path) {
+    Journal* j = &sim->journal;
+    journalClose();
+    j->file = fopen(path, "wb");
+    if(!j->file) return 0;
+    if(!j->buffer) j->buffer = malloc(JOURNAL_BUFFER_SIZE);
+    if(!j->buffer) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    j->used = 0;
+    journalWriteHeader();
+    journalFlush();
+    return j->file != NULL;
+}
+
+void journalClose() {
+    Journal* j = &sim->journal;
+    if(!j->file) return;
+    journalFlush();
+    if(j->file) fclose(j->file);
+    j->file = NULL;
+}
+
+// Starts the journal over from the current state, once a checkpoint
+// holds everything it recorded so far
+void journalRestart() {
+    Journal* j = &sim->journal;
+    if(!j->file) return;
+    j->used = 0;
+    fflush(j->file);
+    rewind(j->file);
+    if(ftruncate(fileno(j->file), 0) != 0) {
+        fprintf(stderr, "Journal write failed, journaling stopped\n");
+        fclose(j->file);
+        j->file = NULL;
+        return;
+    }
+    journalWriteHeader();
+    journalFlush();
+}
+
+// Compares a record the replayed run produced with the next one in the
+// journal. Past the end of the journal (a cut-off tail) nothing is
+// checked; after the first difference, nothing more is.
+void journalCheck(const char* bytes, int size) {
+    Journal* j = &sim->journal;
+    if(j->replayDiverged || j->replayPos + size > j->replaySize) return;
+    
+    const char* expected = j->replay + j->replayPos;
+    if(memcmp(expected, bytes, size) != 0) {
+        JournalRecord want, got;
+        memcpy(&want, expected, sizeof(want));
+        memcpy(&got, bytes, sizeof(got));
+        fprintf(stderr, "Replay diverged after %ld records: journal has type %d at minute %d, "
+                        "run gave type %d at minute %d\n",
+                j->replayChecked, want.type, want.time, got.type, got.time);
+        j->replayDiverged = 1;
+        return;
+    }
+    j->replayPos += size;
+    j->replayChecked++;
+}
+
+void journalAppend(const JournalRecord* r, const char* caller) {
+    Journal* j = &sim->journal;
+    char bytes[sizeof(JournalRecord) + JOURNAL_CALLER_SIZE];
+    int size = journalRecordSize(r->type);
+    memcpy(bytes, r, sizeof(JournalRecord));
+    if(caller) {
+        memset(bytes + sizeof(JournalRecord), 0, JOURNAL_CALLER_SIZE);
+        snprintf(bytes + sizeof(JournalRecord), JOURNAL_CALLER_SIZE, "%s", caller);
+    }
+    
+    if(j->replay) {
+        journalCheck(bytes, size);
+        return;
+    }
+    if(j->used + size > JOURNAL_BUFFER_SIZE) journalFlush();
+    if(!j->file) return;
+    memcpy(j->buffer + j->used, bytes, size);
+    j->used += size;
+}
+
+void journalEvent(int type, int a, int b, int c, int d) {
+    if(!sim->journal.file && !sim->journal.replay) return;
+    JournalRecord r = { type, sim->currentTime, { a, b, c, d, 0 } };
+    journalAppend(&r, NULL);
+}
+
+void journalCall(const Emergency* e) {
+    if(!sim->journal.file && !sim->journal.replay) return;
+    JournalRecord r = { JOURNAL_CALL, sim->currentTime,
+                        { e->id, e->location, e->disease, e->age, e->serviceTime } };
+    journalAppend(&r, e->caller);
+}
+
+
+//Change Tracking
+
+// Units, hospitals and calls touched since the last pushed delta (see
+// //HTTP Server), each listed once. Off unless a server runs, so other
+// runs pay one branch per change.
+void noteChange(ChangeSet* set, int key) {
+    if(!sim->trackChanges || idMapGet(&set->seen, key) != -1) return;
+    idMapPut(&set->seen, key, set->count);
+    set->items = reserveArray(set->items, &set->cap, set->count + 1, sizeof(int));
+    set->items[set->count++] = key;
+}
+
+void clearChanges(ChangeSet* set) {
+    if(set->count == 0) return;
+    set->count = 0;
+    idMapClear(&set->seen);
+}
+
+
+//Map Setup
+
+void reserveLocations(int needed) {
+    if(needed <= sim->locationCap) return;
+    
+    int cap = sim->locationCap;
+    sim->locations = reserveArray(sim->locations, &cap, needed, sizeof(Location));
+    sim->roads = realloc(sim->roads, cap * sizeof(Road*));
+    sim->csrOffset = realloc(sim->csrOffset, (cap + 1) * sizeof(int));
+    sim->scratchDist = realloc(sim->scratchDist, cap * sizeof(int));
+    sim->scratchOwner = realloc(sim->scratchOwner, cap * sizeof(int));
+    sim->scratchTouched = realloc(sim->scratchTouched, cap * sizeof(int));
+    if(!sim->roads || !sim->csrOffset || !sim->scratchDist || !sim->scratchOwner || !sim->scratchTouched) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    sim->locationCap = cap;
+}
+
+void reservePending(int needed) {
+    if(needed <= sim->queueCap) return;
+    
+    int cap = sim->queueCap;
+    sim->pendingRecords = reserveArray(sim->pendingRecords, &cap, needed, sizeof(Emergency));
+    sim->pendingHeap = realloc(sim->pendingHeap, cap * sizeof(QueueKey));
+    sim->pendingPos = realloc(sim->pendingPos, cap * sizeof(int));
+    sim->freePendingSlots = realloc(sim->freePendingSlots, cap * sizeof(int));
+    if(!sim->pendingHeap || !sim->pendingPos || !sim->freePendingSlots) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    sim->queueCap = cap;
+}
+
+void reserveUnits(int needed) {
+    if(needed <= sim->ambulanceCap) return;
+    
+    int cap = sim->ambulanceCap;
+    sim->ambulances = reserveArray(sim->ambulances, &cap, needed, sizeof(Ambulance));
+    sim->unitState = realloc(sim->unitState, cap);
+    sim->unitLocation = realloc(sim->unitLocation, cap * sizeof(int));
+    sim->unitAvailableAt = realloc(sim->unitAvailableAt, cap * sizeof(int));
+    sim->idleUnits = realloc(sim->idleUnits, cap * sizeof(int));
+    if(!sim->unitState || !sim->unitLocation || !sim->unitAvailableAt || !sim->idleUnits) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    sim->ambulanceCap = cap;
+}
+
+// Slots are handed out below activeCap, so pages always cover them
+void reserveActive(int needed) {
+    if(needed <= sim->activeCap) return;
+    
+    int cap = sim->activeCap;
+    sim->activeList = reserveArray(sim->activeList, &cap, needed, sizeof(int));
+    sim->activePos = realloc(sim->activePos, cap * sizeof(int));
+    sim->freeActiveSlots = realloc(sim->freeActiveSlots, cap * sizeof(int));
+    int pages = (cap + ACTIVE_PAGE_SIZE - 1) / ACTIVE_PAGE_SIZE;
+    sim->activePages = realloc(sim->activePages, pages * sizeof(Emergency*));
+    if(!sim->activePos || !sim->freeActiveSlots || !sim->activePages) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    while(sim->activePageCount < pages) {
+        Emergency* page = malloc(ACTIVE_PAGE_SIZE * sizeof(Emergency));
+        if(!page) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        sim->activePages[sim->activePageCount++] = page;
+    }
+    sim->activeCap = cap;
+}
+
+// Pre-sizes every store for a scenario so loading it does not regrow
+// anything. Stores still grow on demand past these numbers.
+void reserveCapacity(int locs, int hosps, int units, int calls) {
+    reserveLocations(locs);
+    sim->hospitals = reserveArray(sim->hospitals, &sim->hospitalCap, hosps, sizeof(Hospital));
+    reserveUnits(units);
+    reserveActive(calls);
+    reservePending(calls);
+}
+
+int addLocation(const char* name, int x, int y) {
+    reserveLocations(sim->locationCount + 1);
+    
+    int id = sim->locationCount++;
+    snprintf(sim->locations[id].name, sizeof(sim->locations[id].name), "%s", name);
+    sim->locations[id].x = x;
+    sim->locations[id].y = y;
+    sim->roads[id] = NULL;
+    sim->scratchDist[id] = 99999;
+    sim->scratchOwner[id] = -1;
+    
+    sim->csrValid = 0;
+    sim->chValid = 0;
+    sim->distMatrixValid = 0;
+    sim->spatialValid = 0;
+    return id;
+}
+
+void setupLocations() {
+    addLocation("City Center", 0, 0);
+    addLocation("Main Street", 4, 0);
+    addLocation("Park Avenue", 10, 0);
+    addLocation("Shopping Mall", 15, 0);
+    addLocation("University", 18, 0);
+    addLocation("Airport", 25, 0);
+    addLocation("North Market", 0, 8);
+    addLocation("Residential", 4, 8);
+    addLocation("Industrial Zone", 30, 0);
+    addLocation("Tech Park", 33, 0);
+}
+
+// Builds the road lists a mapped snapshot left out, in CSR order
+void ensureRoadLists() {
+    if(!sim->roadListsPending) return;
+    sim->roadListsPending = 0;
+    
+    for(int v = 0; v < sim->mappedNodes; v++) {
+        for(int e = sim->csrOffset[v + 1] - 1; e >= sim->csrOffset[v]; e--) {
+            Road* r = arenaAlloc(&sim->roadArena, sizeof(Road));
+            r->destination = sim->csrTarget[e];
+            r->distance = sim->mappedRoadDistance[e];
+            r->profile = sim->csrProfile[e];
+            r->closed = sim->mappedRoadClosed[e];
+            r->next = sim->roads[v]; sim->roads[v] = r;
+        }
+    }
+}
+
+// Moves the mapped CSR arrays to the heap and unmaps the snapshot, before
+// anything reallocates or frees them
+void releaseMappedGraph() {
+    if(!sim->graphMap) return;
+    ensureRoadLists();
+    
+    size_t bytes = ((size_t)sim->roadCount + 1) * sizeof(int);
+    int* target = malloc(bytes);
+    int* weight = malloc(bytes);
+    int* profile = malloc(bytes);
+    if(!target || !weight || !profile) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    memcpy(target, sim->csrTarget, sim->roadCount * sizeof(int));
+    memcpy(weight, sim->csrWeight, sim->roadCount * sizeof(int));
+    memcpy(profile, sim->csrProfile, sim->roadCount * sizeof(int));
+    sim->csrTarget = target;
+    sim->csrWeight = weight;
+    sim->csrProfile = profile;
+    
+    munmap(sim->graphMap, sim->graphMapSize);
+    sim->graphMap = NULL;
+    sim->mappedRoadDistance = NULL;
+    sim->mappedRoadClosed = NULL;
+}
+
+void addRoad(int from, int to, int distance) {
+    ensureRoadLists();
+    Road* r1 = arenaAlloc(&sim->roadArena, sizeof(Road));
+    r1->destination = to; r1->distance = distance; r1->profile = 0; r1->closed = 0;
+    r1->next = sim->roads[from]; sim->roads[from] = r1;
+    
+    Road* r2 = arenaAlloc(&sim->roadArena, sizeof(Road));
+    r2->destination = from; r2->distance = distance; r2->profile = 0; r2->closed = 0;
+    r2->next = sim->roads[to]; sim->roads[to] = r2;
+    
+    sim->roadCount += 2;
+    sim->csrValid = 0;
+    sim->chValid = 0;
+    sim->distMatrixValid = 0;
+}
+
+void clearRoads() {
+    releaseMappedGraph();
+    for(int i = 0; i < sim->locationCount; i++) sim->roads[i] = NULL;
+    arenaReset(&sim->roadArena);
+    sim->roadCount = 0;
+    sim->closedRoads = 0;
+    sim->csrValid = 0;
+    sim->chValid = 0;
+    sim->distMatrixValid = 0;
+}
+
+void setupRoads() {
+    clearRoads();
+    addRoad(0,1,4); addRoad(1,2,6); addRoad(2,3,5);
+    addRoad(3,4,3); addRoad(4,5,7); addRoad(1,5,10);
+    addRoad(0,6,8); addRoad(6,7,4); addRoad(7,3,6);
+    addRoad(5,8,5); addRoad(8,9,3);
+}
+
+void addHospital(const char* name, int loc, int cap, DiseaseType spec) {
+    sim->hospitals = reserveArray(sim->hospitals, &sim->hospitalCap, sim->hospitalCount + 1, sizeof(Hospital));
+    
+    snprintf(sim->hospitals[sim->hospitalCount].name, sizeof(sim->hospitals[sim->hospitalCount].name), "%s", name);
+    sim->hospitals[sim->hospitalCount].location = loc;
+    sim->hospitals[sim->hospitalCount].capacity = cap;
+    sim->hospitals[sim->hospitalCount].patients = 0;
+    sim->hospitals[sim->hospitalCount].specialty = spec;
+    sim->hospitalCount++;
+    sim->spatialValid = 0;
+}
+
+void setupHospitals() {
+    addHospital("City General", 0, 10, GENERAL);
+    addHospital("Heart Center", 5, 5, CARDIAC);
+    addHospital("Trauma Unit", 9, 8, TRAUMA);
+    addHospital("Children's Hospital", 6, 6, RESPIRATORY);
+}
+
+void addAmbulance(int loc, int baseHospital) {
+    reserveUnits(sim->ambulanceCount + 1);
+    
+    Ambulance* a = &sim->ambulances[sim->ambulanceCount];
+    a->id = sim->ambulanceCount + 1;
+    sim->unitState[sim->ambulanceCount] = IDLE;
+    sim->unitLocation[sim->ambulanceCount] = loc;
+    sim->unitAvailableAt[sim->ambulanceCount] = 0;
+    a->targetEmergency = -1;
+    a->targetHospital = -1;
+    a->estimatedArrival = 0;
+    a->baseHospital = baseHospital;
+    a->timerVersion = 0;
+    a->legStart = 0;
+    sim->ambulanceCount++;
+    sim->idleAmbulances++;
+    sim->spatialValid = 0;
+}
+
+void setupAmbulances() {
+    addAmbulance(1, 0);
+    addAmbulance(4, 0);
+    addAmbulance(7, 0);
+    for(int i = 3; i < DEFAULT_AMBULANCES; i++)
+        addAmbulance(0, 0);
+}
+
+
+//Traffic Profiles
+
+// Road minutes are free-flow times. A road may follow a profile: a
+// piecewise-linear slowdown over the day, given as (minute of day,
+// percent) points and wrapping at midnight. Percents below 100 are
+// raised to 100, so free-flow minutes stay a lower bound for the
+// spatial index and guided searches. Each profile is sampled once per
+// TRAFFIC_BUCKET_MINUTES into trafficPercent.
+int defineTrafficProfile(int profile, int points, const int minute[], const int percent[]) {
+    if(profile < 1 || profile >= TRAFFIC_MAX_PROFILES || points < 1 || points > TRAFFIC_MAX_POINTS)
+        return 0;
+    for(int i = 0; i < points; i++) {
+        if(minute[i] < 0 || minute[i] >= 24 * 60 || percent[i] < 0) return 0;
+        if(i > 0 && minute[i] <= minute[i - 1]) return 0;
+    }
+    
+    TrafficProfile* p = &sim->trafficProfiles[profile];
+    p->points = points;
+    memcpy(p->minute, minute, points * sizeof(int));
+    memcpy(p->percent, percent, points * sizeof(int));
+    
+    for(int b = 0; b < TRAFFIC_BUCKETS; b++) {
+        int at = b * TRAFFIC_BUCKET_MINUTES + TRAFFIC_BUCKET_MINUTES / 2;
+        
+        // Segment [prev, next) around `at`, wrapping past midnight
+        int next = 0;
+        while(next < points && minute[next] <= at) next++;
+        int prev = next == 0 ? points - 1 : next - 1;
+        next = next == points ? 0 : next;
+        
+        int from = minute[prev], to = minute[next];
+        if(from > at) from -= 24 * 60;
+        if(to <= from) to += 24 * 60;
+        double value = percent[prev] + (double)(percent[next] - percent[prev]) * (at - from) / (to - from);
+        
+        int rounded = (int)(value + 0.5);
+        sim->trafficPercent[profile][b] = rounded < 100 ? 100 : rounded;
+    }
+    sim->trafficRowsValid = 0;
+    return 1;
+}
+
+// Puts both directions of every road between from and to on a profile
+// (0 = free flow). Returns 0 if the profile has not been defined.
+int setRoadProfile(int from, int to, int profile) {
+    if(profile < 0 || profile >= TRAFFIC_MAX_PROFILES) return 0;
+    if(profile != 0 && sim->trafficProfiles[profile].points == 0) return 0;
+    ensureRoadLists();
+    
+    for(Road* r = sim->roads[from]; r != NULL; r = r->next)
+        if(r->destination == to) r->profile = profile;
+    for(Road* r = sim->roads[to]; r != NULL; r = r->next)
+        if(r->destination == from) r->profile = profile;
+    
+    if(profile != 0) sim->trafficEnabled = 1;
+    sim->csrValid = 0;
+    return 1;
+}
+
+// Routes are timed from the start of the current bucket, so every query
+// in one bucket sees the same traffic and can share cached rows
+int trafficDeparture() {
+    return sim->trafficEnabled ? sim->currentTime - sim->currentTime % TRAFFIC_BUCKET_MINUTES : 0;
+}
+
+int trafficTravel(int base, int profile, int at) {
+    int bucket = (at / TRAFFIC_BUCKET_MINUTES) % TRAFFIC_BUCKETS;
+    return (base * sim->trafficPercent[profile][bucket] + 99) / 100;
+}
+
+// Minutes to cross CSR edge e entering it at absolute minute `at`.
+// Waiting for a later, faster bucket counts, so leaving later never
+// means arriving earlier (FIFO), which time-dependent Dijkstra needs.
+// A closed road keeps its profile but is never worth waiting for.
+int roadMinutes(int e, int at) {
+    if(!sim->trafficEnabled || sim->csrProfile[e] == 0 || sim->csrWeight[e] >= 99999)
+        return sim->csrWeight[e];
+    
+    int base = sim->csrWeight[e], profile = sim->csrProfile[e];
+    int arrival = at + trafficTravel(base, profile, at);
+    for(int start = at - at % TRAFFIC_BUCKET_MINUTES + TRAFFIC_BUCKET_MINUTES; start < arrival;
+        start += TRAFFIC_BUCKET_MINUTES) {
+        int later = start + trafficTravel(base, profile, start);
+        if(later < arrival) arrival = later;
+    }
+    return arrival - at;
+}
+
+
+//Shortest Route Calculation
+
+double straightLine(int a, int b) {
+    double dx = sim->locations[a].x - sim->locations[b].x;
+    double dy = sim->locations[a].y - sim->locations[b].y;
+    return sqrt(dx * dx + dy * dy);
+}
+
+// Fewest minutes any route from a to b can take (0 until the road
+// graph is built, or if the map has no usable coordinates)
+double routeLowerBound(int a, int b) {
+    return straightLine(a, b) * sim->minutesPerUnit;
+}
+
+// Compressed-sparse-row copy of roads[]: the neighbours of node v are
+// csrTarget[csrOffset[v] .. csrOffset[v+1]-1], stored contiguously.
+void buildRoadGraph() {
+    releaseMappedGraph();
+    sim->csrTarget = realloc(sim->csrTarget, (sim->roadCount + 1) * sizeof(int));
+    sim->csrWeight = realloc(sim->csrWeight, (sim->roadCount + 1) * sizeof(int));
+    sim->csrProfile = realloc(sim->csrProfile, (sim->roadCount + 1) * sizeof(int));
+    if(!sim->csrTarget || !sim->csrWeight || !sim->csrProfile) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    
+    double minutesPerUnit = HUGE_VAL;
+    sim->csrOffset[0] = 0;
+    for(int v = 0; v < sim->locationCount; v++) {
+        int e = sim->csrOffset[v];
+        for(Road* r = sim->roads[v]; r != NULL; r = r->next) {
+            sim->csrTarget[e] = r->destination;
+            sim->csrWeight[e] = r->closed ? 99999 : r->distance;
+            sim->csrProfile[e] = r->profile;
+            e++;
+            
+            // Closed roads count too: they may reopen without a rebuild
+            double length = straightLine(v, r->destination);
+            if(length > 0 && r->distance / length < minutesPerUnit)
+                minutesPerUnit = r->distance / length;
+        }
+        sim->csrOffset[v + 1] = e;
+    }
+    
+    // Shaved a little so rounding can never make the bound overshoot
+    sim->minutesPerUnit = minutesPerUnit == HUGE_VAL ? 0 : minutesPerUnit * (1 - 1e-9);
+    sim->csrValid = 1;
+    sim->landmarksValid = 0;
+    sim->chValid = 0;
+    sim->trafficRowsValid = 0;
+}
+
+// First write to a scratch entry in this query
+void scratchTouch(int v) {
+    if(sim->scratchDist[v] == 99999 && sim->scratchOwner[v] == -1)
+        sim->scratchTouched[sim->scratchTouchedCount++] = v;
+}
+
+// Puts back only the entries the last query wrote, so a search that
+// settles a few hundred nodes does not pay for clearing the whole map
+void scratchReset() {
+    for(int i = 0; i < sim->scratchTouchedCount; i++) {
+        sim->scratchDist[sim->scratchTouched[i]] = 99999;
+        sim->scratchOwner[sim->scratchTouched[i]] = -1;
+    }
+    sim->scratchTouchedCount = 0;
+}
+
+void nodeHeapPush(NodeHeap* heap, int dist, int node) {
+    if(heap->size == heap->cap) {
+        heap->cap = heap->cap ? heap->cap * 2 : 64;
+        heap->items = realloc(heap->items, heap->cap * sizeof(HeapNode));
+        if(!heap->items) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+    int i = heap->size++;
+    while(i > 0 && heap->items[(i-1)/2].dist > dist) {
+        heap->items[i] = heap->items[(i-1)/2];
+        i = (i-1)/2;
+    }
+    heap->items[i].dist = dist;
+    heap->items[i].node = node;
+}
+
+HeapNode nodeHeapPop(NodeHeap* heap) {
+    HeapNode top = heap->items[0];
+    HeapNode last = heap->items[--heap->size];
+    
+    int i = 0;
+    while(1) {
+        int child = 2*i + 1;
+        if(child >= heap->size) break;
+        if(child + 1 < heap->size && heap->items[child + 1].dist < heap->items[child].dist)
+            child++;
+        if(heap->items[child].dist >= last.dist) break;
+        heap->items[i] = heap->items[child];
+        i = child;
+    }
+    if(heap->size > 0) heap->items[i] = last;
+    
+    return top;
+}
+
+// Single-source shortest paths over the CSR graph with a binary heap
+// (lazy deletion), O(E log V). predecessor may be NULL. A negative
+// depart means free-flow minutes; otherwise roads are timed for a
+// departure at absolute minute `depart`.
+void shortestPathTree(int source, int depart, int distance[], int predecessor[]) {
+    if(!sim->csrValid) buildRoadGraph();
+    
+    for(int i = 0; i < sim->locationCount; i++) {
+        distance[i] = 99999;
+        if(predecessor) predecessor[i] = -1;
+    }
+    distance[source] = 0;
+    
+    sim->pathHeap.size = 0;
+    nodeHeapPush(&sim->pathHeap, 0, source);
+    
+    while(sim->pathHeap.size > 0) {
+        HeapNode h = nodeHeapPop(&sim->pathHeap);
+        if(h.dist > distance[h.node]) continue;
+        
+        for(int e = sim->csrOffset[h.node]; e < sim->csrOffset[h.node + 1]; e++) {
+            int v = sim->csrTarget[e];
+            int newDist = h.dist + (depart < 0 ? sim->csrWeight[e] : roadMinutes(e, depart + h.dist));
+            if(newDist < distance[v]) {
+                distance[v] = newDist;
+                if(predecessor) predecessor[v] = h.node;
+                nodeHeapPush(&sim->pathHeap, newDist, v);
+            }
+        }
+    }
+}
+
+// Point-to-point Dijkstra that stops as soon as `to` is settled. Used
+// when the map is too large to keep an all-pairs matrix.
+int shortestPathTo(int from, int to) {
+    if(!sim->csrValid) buildRoadGraph();
+    
+    int depart = trafficDeparture();
+    int* distance = sim->scratchDist;
+    scratchTouch(from);
+    distance[from] = 0;
+    
+    sim->pathHeap.size = 0;
+    nodeHeapPush(&sim->pathHeap, 0, from);
+    
+    while(sim->pathHeap.size > 0) {
+        HeapNode h = nodeHeapPop(&sim->pathHeap);
+        if(h.dist > distance[h.node]) continue;
+        sim->stats.shortestPathSettled++;
+        if(h.node == to) break;
+        
+        for(int e = sim->csrOffset[h.node]; e < sim->csrOffset[h.node + 1]; e++) {
+            int v = sim->csrTarget[e];
+            int newDist = h.dist + roadMinutes(e, depart + h.dist);
+            if(newDist < distance[v]) {
+                scratchTouch(v);
+                distance[v] = newDist;
+                nodeHeapPush(&sim->pathHeap, newDist, v);
+            }
+        }
+    }
+    
+    int dist = distance[to];
+    scratchReset();
+    return dist;
+}
+
+// Landmarks for ALT routing: a few nodes spread far apart, with exact
+// distances to every node stored node-major (landmarkDist[v * count + k])
+// so one node's bounds share a cache line. Picked greedily from node 0,
+// each new landmark being the node farthest from those chosen so far.
+// No random draws, so switching routing never shifts a run's RNG.
+void buildLandmarks() {
+    if(!sim->csrValid) buildRoadGraph();
+    
+    int n = sim->locationCount;
+    int count = n < ALT_LANDMARKS ? n : ALT_LANDMARKS;
+    int* row = malloc(n * sizeof(int));
+    int* nearest = malloc(n * sizeof(int));
+    free(sim->landmarkDist);
+    sim->landmarkDist = malloc((size_t)n * count * sizeof(int));
+    if(!row || !nearest || !sim->landmarkDist) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    
+    for(int v = 0; v < n; v++) nearest[v] = INT_MAX;
+    int landmark = 0;
+    for(int k = 0; k < count; k++) {
+        shortestPathTree(landmark, -1, row, NULL);
+        
+        int farthest = landmark, farthestDist = -1;
+        for(int v = 0; v < n; v++) {
+            sim->landmarkDist[(size_t)v * count + k] = row[v];
+            if(row[v] < nearest[v]) nearest[v] = row[v];
+            // Unreachable nodes would make useless landmarks
+            if(nearest[v] < 99999 && nearest[v] > farthestDist) {
+                farthestDist = nearest[v];
+                farthest = v;
+            }
+        }
+        landmark = farthest;
+    }
+    
+    sim->landmarkCount = count;
+    sim->landmarksValid = 1;
+    free(row);
+    free(nearest);
+}
+
+// Admissible, consistent lower bound on the route from v to `to`: the
+// straight-line bound, and with ALT the best landmark triangle bound
+// |d(L,to) - d(L,v)|. Both are whole minutes.
+int routeHeuristic(int v, int to) {
+    int bound = (int)routeLowerBound(v, to);
+    
+    if(sim->routing == ROUTE_ALT) {
+        const int* dv = &sim->landmarkDist[(size_t)v * sim->landmarkCount];
+        const int* dt = &sim->landmarkDist[(size_t)to * sim->landmarkCount];
+        for(int k = 0; k < sim->landmarkCount; k++) {
+            if(dv[k] >= 99999 || dt[k] >= 99999) continue;
+            int diff = dt[k] > dv[k] ? dt[k] - dv[k] : dv[k] - dt[k];
+            if(diff > bound) bound = diff;
+        }
+    }
+    return bound;
+}
+
+// A* over the CSR graph, heap keyed on distance + heuristic. With a
+// consistent heuristic the target's distance is final when it is
+// popped, so answers match shortestPathTo while settling fewer nodes.
+// Both bounds come from free-flow minutes, which traffic only slows,
+// so they stay consistent with time-dependent roads.
+int guidedPathTo(int from, int to) {
+    if(!sim->csrValid) buildRoadGraph();
+    if(sim->routing == ROUTE_ALT && !sim->landmarksValid) buildLandmarks();
+    
+    int depart = trafficDeparture();
+    int* distance = sim->scratchDist;
+    scratchTouch(from);
+    distance[from] = 0;
+    
+    sim->pathHeap.size = 0;
+    nodeHeapPush(&sim->pathHeap, routeHeuristic(from, to), from);
+    
+    while(sim->pathHeap.size > 0) {
+        HeapNode h = nodeHeapPop(&sim->pathHeap);
+        if(h.dist > distance[h.node] + routeHeuristic(h.node, to)) continue;
+        sim->stats.shortestPathSettled++;
+        if(h.node == to) break;
+        
+        for(int e = sim->csrOffset[h.node]; e < sim->csrOffset[h.node + 1]; e++) {
+            int v = sim->csrTarget[e];
+            int newDist = distance[h.node] + roadMinutes(e, depart + distance[h.node]);
+            if(newDist < distance[v]) {
+                scratchTouch(v);
+                distance[v] = newDist;
+                nodeHeapPush(&sim->pathHeap, newDist + routeHeuristic(v, to), v);
+            }
+        }
+    }
+    
+    int dist = distance[to];
+    scratchReset();
+    return dist;
+}
+
+// All-pairs distances, one Dijkstra per source, rebuilt only after the
+// road graph changes. Row `from` holds the distances from `from`; rows
+// are padded to a 64-byte multiple so each starts on a cache line.
+void buildDistanceMatrix() {
+    sim->stats.distanceMatrixBuilds++;
+    free(sim->distMatrix);
+    sim->distMatrixStride = (sim->locationCount + 15) & ~15;
+    sim->distMatrix = aligned_alloc(64, (size_t)sim->locationCount * sim->distMatrixStride * sizeof(int));
+    free(sim->distRowStale);
+    sim->distRowStale = calloc(sim->locationCount, 1);
+    if(!sim->distMatrix || !sim->distRowStale) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    
+    for(int from = 0; from < sim->locationCount; from++)
+        shortestPathTree(from, -1, &sim->distMatrix[(size_t)from * sim->distMatrixStride], NULL);
+    sim->distMatrixValid = 1;
+}
+
+void refreshDistanceRow(int from) {
+    long start = monotonicNanos();
+    shortestPathTree(from, -1, &sim->distMatrix[(size_t)from * sim->distMatrixStride], NULL);
+    sim->distRowStale[from] = 0;
+    sim->stats.distanceRowRepairs++;
+    recordElapsed(&sim->stats.searchNanos, start);
+}
+
+// With traffic the all-pairs matrix would go stale every bucket, so
+// small maps keep one row per source instead, recomputed the first time
+// the source is asked about in a new bucket.
+const int* trafficRow(int from) {
+    // Rebuilding the road graph drops the cached rows
+    if(!sim->csrValid) buildRoadGraph();
+    
+    int n = sim->locationCount;
+    if(!sim->trafficRowsValid) {
+        free(sim->trafficRows);
+        free(sim->trafficRowBucket);
+        sim->trafficRows = malloc((size_t)n * n * sizeof(int));
+        sim->trafficRowBucket = malloc(n * sizeof(int));
+        if(!sim->trafficRows || !sim->trafficRowBucket) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        for(int i = 0; i < n; i++) sim->trafficRowBucket[i] = -1;
+        sim->trafficRowsValid = 1;
+    }
+    
+    int depart = trafficDeparture();
+    int* row = &sim->trafficRows[(size_t)from * n];
+    if(sim->trafficRowBucket[from] != depart / TRAFFIC_BUCKET_MINUTES) {
+        long start = monotonicNanos();
+        shortestPathTree(from, depart, row, NULL);
+        sim->trafficRowBucket[from] = depart / TRAFFIC_BUCKET_MINUTES;
+        sim->stats.shortestPathSearches++;
+        recordElapsed(&sim->stats.searchNanos, start);
+    }
+    return row;
+}
+
+int chDistance(int from, int to);
+
+int findShortestPath(int from, int to) {
+    sim->stats.shortestPathCalls++;
+    if(sim->locationCount > DIST_MATRIX_MAX_LOCATIONS) {
+        long start = monotonicNanos();
+        int dist;
+        // The hierarchy is built on free-flow minutes with every road open
+        if(sim->routing == ROUTE_CH && !sim->trafficEnabled && sim->closedRoads == 0) dist = chDistance(from, to);
+        else if(sim->routing == ROUTE_DIJKSTRA) dist = shortestPathTo(from, to);
+        else dist = guidedPathTo(from, to);
+        sim->stats.shortestPathSearches++;
+        recordElapsed(&sim->stats.searchNanos, start);
+        return dist;
+    }
+    
+    if(sim->trafficEnabled) return trafficRow(from)[to];
+    if(!sim->distMatrixValid) buildDistanceMatrix();
+    if(sim->distRowStale[from]) refreshDistanceRow(from);
+    return sim->distMatrix[(size_t)from * sim->distMatrixStride + to];
+}
+
+
+//Road Closures
+
+// Rewrites node v's CSR weights from its road list; closed roads get
+// the 99999 sentinel, which no search can ever improve on
+void patchRoadGraphRow(int v) {
+    int e = sim->csrOffset[v];
+    for(Road* r = sim->roads[v]; r != NULL; r = r->next)
+        sim->csrWeight[e++] = r->closed ? 99999 : r->distance;
+}
+
+// A closure only lengthens routes through the road, and only sources
+// whose shortest-path tree uses it (d(s,a) + w == d(s,b) either way)
+// can have one. Those rows are marked stale and recomputed the next
+// time they are asked for; every other row stays exact.
+void markRowsThrough(int a, int b, int weight) {
+    int n = sim->locationCount;
+    for(int s = 0; s < n; s++) {
+        if(sim->distRowStale[s]) continue;
+        const int* row = &sim->distMatrix[(size_t)s * sim->distMatrixStride];
+        if(row[a] >= 99999) continue;
+        if(row[a] + weight == row[b] || row[b] + weight == row[a])
+            sim->distRowStale[s] = 1;
+    }
+}
+
+// A reopened road of `weight` minutes can only shorten routes, and any
+// new shortest route crosses it once:
+//     d'(s,t) = min(d(s,t), d(s,a) + w + d(b,t), d(s,b) + w + d(a,t))
+// O(n^2) instead of n fresh searches. Stale rows are left for their
+// own recomputation.
+void relaxRowsThrough(int a, int b, int weight) {
+    if(sim->distRowStale[a]) refreshDistanceRow(a);
+    if(sim->distRowStale[b]) refreshDistanceRow(b);
+    
+    int n = sim->locationCount;
+    const int* fromA = &sim->distMatrix[(size_t)a * sim->distMatrixStride];
+    const int* fromB = &sim->distMatrix[(size_t)b * sim->distMatrixStride];
+    for(int s = 0; s < n; s++) {
+        if(sim->distRowStale[s]) continue;
+        int* row = &sim->distMatrix[(size_t)s * sim->distMatrixStride];
+        int viaA = row[a] + weight, viaB = row[b] + weight;
+        if(viaA >= 99999 && viaB >= 99999) continue;
+        for(int t = 0; t < n; t++) {
+            int best = viaA + fromB[t] < viaB + fromA[t] ? viaA + fromB[t] : viaB + fromA[t];
+            if(best < row[t]) row[t] = best;
+        }
+    }
+}
+
+// Same idea for the traffic rows, which keep their memory: traffic only
+// lengthens roads, so a row can only have crossed a-b if its two ends
+// are at least the free-flow `weight` apart. Those rows, or every row
+// after a reopen, are recomputed the next time they are asked for.
+void expireTrafficRows(int a, int b, int weight, int closed) {
+    if(!sim->trafficRowsValid) return;
+    int n = sim->locationCount;
+    for(int s = 0; s < n; s++) {
+        if(sim->trafficRowBucket[s] == -1) continue;
+        const int* row = &sim->trafficRows[(size_t)s * n];
+        if(closed && (row[a] >= 99999 || abs(row[a] - row[b]) < weight)) continue;
+        sim->trafficRowBucket[s] = -1;
+    }
+}
+
+void retimeLegs();
+
+int setRoadClosed(int from, int to, int closed) {
+    ensureRoadLists();
+    int changed = 0, weight = 99999;
+    for(Road* r = sim->roads[from]; r != NULL; r = r->next) {
+        if(r->destination != to || r->closed == closed) continue;
+        r->closed = closed;
+        if(r->distance < weight) weight = r->distance;
+        changed++;
+    }
+    for(Road* r = sim->roads[to]; r != NULL; r = r->next)
+        if(r->destination == from) r->closed = closed;
+    if(changed == 0) return 0;
+    
+    sim->closedRoads += closed ? changed : -changed;
+    if(sim->csrValid) {
+        patchRoadGraphRow(from);
+        patchRoadGraphRow(to);
+    }
+    if(sim->distMatrixValid) {
+        if(closed) markRowsThrough(from, to, weight);
+        else relaxRowsThrough(from, to, weight);
+    }
+    // Landmark bounds stay admissible when roads only get longer
+    if(!closed) sim->landmarksValid = 0;
+    expireTrafficRows(from, to, weight, closed);
+    retimeLegs();
+    return 1;
+}
+
+// Closes every open road between from and to, e.g. after an accident.
+// Returns 0 if there was none. Cached routes are repaired in place.
+int closeRoad(int from, int to) {
+    if(!setRoadClosed(from, to, 1)) return 0;
+    journalEvent(JOURNAL_CLOSE, from, to, 0, 0);
+    return 1;
+}
+
+int reopenRoad(int from, int to) {
+    if(!setRoadClosed(from, to, 0)) return 0;
+    journalEvent(JOURNAL_REOPEN, from, to, 0, 0);
+    return 1;
+}
+
+
+//Contraction Hierarchies
+
+// Nodes are contracted one at a time, least important first (fewest
+// shortcuts added, spread out by how many neighbours are already gone).
+// Contracting v links each pair of its remaining neighbours with a
+// shortcut unless a witness route avoiding v is no longer. Afterwards
+// every shortest route climbs to a top node and descends again, so a
+// query only searches upward edges from both ends.
+typedef struct {
+    int target;
+    int weight;
+} ChEdge;
+
+typedef struct {
+    ChEdge* edges;
+    int count, cap;
+} ChAdjacency;
+
+// Adds the edge a->b, or shortens it if it is already there
+void chLink(ChAdjacency* adj, int a, int b, int weight) {
+    for(int k = 0; k < adj[a].count; k++) {
+        if(adj[a].edges[k].target == b) {
+            if(weight < adj[a].edges[k].weight) adj[a].edges[k].weight = weight;
+            return;
+        }
+    }
+    adj[a].edges = reserveArray(adj[a].edges, &adj[a].cap, adj[a].count + 1, sizeof(ChEdge));
+    adj[a].edges[adj[a].count].target = b;
+    adj[a].edges[adj[a].count].weight = weight;
+    adj[a].count++;
+}
+
+void chUnlink(ChAdjacency* adj, int a, int b) {
+    for(int k = 0; k < adj[a].count; k++) {
+        if(adj[a].edges[k].target == b) {
+            adj[a].edges[k] = adj[a].edges[--adj[a].count];
+            return;
+        }
+    }
+}
+
+// Working graph while contracting. isTarget marks the neighbours a
+// witness search still has to reach, so it can stop once all are settled.
+typedef struct {
+    ChAdjacency* adj;
+    int* removedNeighbours;
+    char* isTarget;
+} ChBuild;
+
+// Bounded Dijkstra from u over the remaining graph without `via`,
+// leaving distances in scratchDist. Gives up past `limit` minutes or
+// maxSettled nodes; a missed witness only costs a spare shortcut.
+void chWitnessSearch(ChBuild* cb, int u, int via, int limit, int targets, int maxSettled) {
+    int* distance = sim->scratchDist;
+    scratchTouch(u);
+    distance[u] = 0;
+    
+    sim->pathHeap.size = 0;
+    nodeHeapPush(&sim->pathHeap, 0, u);
+    
+    int settled = 0;
+    while(sim->pathHeap.size > 0 && settled < maxSettled && targets > 0) {
+        HeapNode h = nodeHeapPop(&sim->pathHeap);
+        if(h.dist > distance[h.node]) continue;
+        if(h.dist > limit) break;
+        settled++;
+        if(cb->isTarget[h.node]) targets--;
+        
+        ChAdjacency* a = &cb->adj[h.node];
+        for(int k = 0; k < a->count; k++) {
+            int v = a->edges[k].target;
+            int newDist = h.dist + a->edges[k].weight;
+            if(v != via && newDist < distance[v]) {
+                scratchTouch(v);
+                distance[v] = newDist;
+                nodeHeapPush(&sim->pathHeap, newDist, v);
+            }
+        }
+    }
+}
+
+// Shortcuts that contracting v needs; added to the graph unless simulate.
+// Simulated runs (priority estimates) use a smaller witness budget.
+int chContract(ChBuild* cb, int v, int simulate) {
+    ChAdjacency* a = &cb->adj[v];
+    int shortcuts = 0;
+    
+    for(int i = 0; i + 1 < a->count; i++) {
+        int u = a->edges[i].target;
+        int toU = a->edges[i].weight;
+        
+        int longest = 0;
+        for(int j = i + 1; j < a->count; j++) {
+            cb->isTarget[a->edges[j].target] = 1;
+            if(a->edges[j].weight > longest) longest = a->edges[j].weight;
+        }
+        chWitnessSearch(cb, u, v, toU + longest, a->count - i - 1,
+                        simulate ? CH_WITNESS_SETTLE / 5 : CH_WITNESS_SETTLE);
+        
+        for(int j = i + 1; j < a->count; j++) {
+            int w = a->edges[j].target;
+            int via = toU + a->edges[j].weight;
+            cb->isTarget[w] = 0;
+            if(sim->scratchDist[w] <= via) continue;
+            shortcuts++;
+            if(!simulate) {
+                chLink(cb->adj, u, w, via);
+                chLink(cb->adj, w, u, via);
+            }
+        }
+        scratchReset();
+    }
+    return shortcuts;
+}
+
+// Edge difference, doubled so it outweighs the spreading term
+int chPriority(ChBuild* cb, int v) {
+    return 2 * (chContract(cb, v, 1) - cb->adj[v].count) + cb->removedNeighbours[v];
+}
+
+void buildContractionHierarchy() {
+    if(!sim->csrValid) buildRoadGraph();
+    
+    int n = sim->locationCount;
+    ChBuild cb;
+    cb.adj = calloc(n, sizeof(ChAdjacency));
+    cb.removedNeighbours = calloc(n, sizeof(int));
+    cb.isTarget = calloc(n, 1);
+    if(!cb.adj || !cb.removedNeighbours || !cb.isTarget) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    ChAdjacency* adj = cb.adj;
+    for(int v = 0; v < n; v++)
+        for(int e = sim->csrOffset[v]; e < sim->csrOffset[v + 1]; e++)
+            if(sim->csrTarget[e] != v) chLink(adj, v, sim->csrTarget[e], sim->csrWeight[e]);
+    
+    free(sim->chRank);
+    sim->chRank = malloc(n * sizeof(int));
+    // Heap entries whose priority no longer matches priority[] are stale
+    int* priority = malloc(n * sizeof(int));
+    if(!sim->chRank || !priority) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    for(int v = 0; v < n; v++) sim->chRank[v] = -1;
+    
+    NodeHeap order = { NULL, 0, 0 };
+    for(int v = 0; v < n; v++) {
+        priority[v] = chPriority(&cb, v);
+        nodeHeapPush(&order, priority[v], v);
+    }
+    
+    int rank = 0;
+    while(order.size > 0) {
+        HeapNode top = nodeHeapPop(&order);
+        int v = top.node;
+        if(sim->chRank[v] != -1 || top.dist != priority[v]) continue;
+        
+        chContract(&cb, v, 0);
+        sim->chRank[v] = rank++;
+        
+        // v's remaining edges all lead up the hierarchy; they stay as
+        // its upward list, v leaves its neighbours' lists and their
+        // priorities are refreshed
+        for(int k = 0; k < adj[v].count; k++)
+            chUnlink(adj, adj[v].edges[k].target, v);
+        for(int k = 0; k < adj[v].count; k++) {
+            int u = adj[v].edges[k].target;
+            cb.removedNeighbours[u]++;
+            int updated = chPriority(&cb, u);
+            if(updated != priority[u]) {
+                priority[u] = updated;
+                nodeHeapPush(&order, updated, u);
+            }
+        }
+    }
+    free(order.items);
+    free(priority);
+    
+    free(sim->chUpOffset);
+    sim->chUpOffset = malloc((n + 1) * sizeof(int));
+    if(!sim->chUpOffset) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    sim->chUpOffset[0] = 0;
+    for(int v = 0; v < n; v++) sim->chUpOffset[v + 1] = sim->chUpOffset[v] + adj[v].count;
+    sim->chUpCount = sim->chUpOffset[n];
+    
+    free(sim->chUpTarget);
+    free(sim->chUpWeight);
+    sim->chUpTarget = malloc((sim->chUpCount + 1) * sizeof(int));
+    sim->chUpWeight = malloc((sim->chUpCount + 1) * sizeof(int));
+    if(!sim->chUpTarget || !sim->chUpWeight) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    for(int v = 0; v < n; v++) {
+        for(int k = 0; k < adj[v].count; k++) {
+            sim->chUpTarget[sim->chUpOffset[v] + k] = adj[v].edges[k].target;
+            sim->chUpWeight[sim->chUpOffset[v] + k] = adj[v].edges[k].weight;
+        }
+        free(adj[v].edges);
+    }
+    free(adj);
+    free(cb.removedNeighbours);
+    free(cb.isTarget);
+}
+
+// Identifies the road graph a hierarchy was built from (FNV-1a)
+unsigned long long roadGraphHash() {
+    if(!sim->csrValid) buildRoadGraph();
+    
+    unsigned long long hash = 0xCBF29CE484222325ULL;
+    const int* parts[] = { sim->csrOffset, sim->csrTarget, sim->csrWeight };
+    int lengths[] = { sim->locationCount + 1, sim->roadCount, sim->roadCount };
+    for(int p = 0; p < 3; p++) {
+        for(int i = 0; i < lengths[p]; i++) {
+            hash ^= (unsigned)parts[p][i];
+            hash *= 0x100000001B3ULL;
+        }
+    }
+    return hash;
+}
+
+// Preprocessed hierarchy on disk: header, then rank[nodes],
+// upOffset[nodes + 1], upTarget[upCount], upWeight[upCount] as native
+// ints. Written to a temporary name and renamed, so a reader never sees
+// half a file.
+typedef struct {
+    char magic[8];
+    int version;
+    int nodes;
+    int upCount;
+    int reserved;
+    unsigned long long graphHash;
+} ChFileHeader;
+
+int saveContractionHierarchy(const char* path) {
+    char tmpPath[4096];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp%ld", path, (long)getpid());
+    FILE* f = fopen(tmpPath, "wb");
+    if(!f) return 0;
+    
+    ChFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CH_FILE_MAGIC, sizeof(header.magic));
+    header.version = CH_FILE_VERSION;
+    header.nodes = sim->locationCount;
+    header.upCount = sim->chUpCount;
+    header.graphHash = roadGraphHash();
+    
+    int n = sim->locationCount;
+    int ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+             fwrite(sim->chRank, sizeof(int), n, f) == (size_t)n &&
+             fwrite(sim->chUpOffset, sizeof(int), n + 1, f) == (size_t)n + 1 &&
+             fwrite(sim->chUpTarget, sizeof(int), sim->chUpCount, f) == (size_t)sim->chUpCount &&
+             fwrite(sim->chUpWeight, sizeof(int), sim->chUpCount, f) == (size_t)sim->chUpCount;
+    if(fclose(f) != 0) ok = 0;
+    
+    if(!ok || rename(tmpPath, path) != 0) {
+        remove(tmpPath);
+        return 0;
+    }
+    return 1;
+}
+
+// Returns 0 if the file is missing, damaged or for another road graph
+int loadContractionHierarchy(const char* path) {
+    FILE* f = fopen(path, "rb");
+    if(!f) return 0;
+    
+    ChFileHeader header;
+    int n = sim->locationCount;
+    if(fread(&header, sizeof(header), 1, f) != 1 ||
+       memcmp(header.magic, CH_FILE_MAGIC, sizeof(header.magic)) != 0 ||
+       header.version != CH_FILE_VERSION || header.nodes != n || header.upCount < 0 ||
+       header.graphHash != roadGraphHash()) {
+        fclose(f);
+        return 0;
+    }
+    
+    int* rank = malloc(n * sizeof(int));
+    int* upOffset = malloc((n + 1) * sizeof(int));
+    int* upTarget = malloc((header.upCount + 1) * sizeof(int));
+    int* upWeight = malloc((header.upCount + 1) * sizeof(int));
+    int ok = rank && upOffset && upTarget && upWeight &&
+             fread(rank, sizeof(int), n, f) == (size_t)n &&
+             fread(upOffset, sizeof(int), n + 1, f) == (size_t)n + 1 &&
+             fread(upTarget, sizeof(int), header.upCount, f) == (size_t)header.upCount &&
+             fread(upWeight, sizeof(int), header.upCount, f) == (size_t)header.upCount &&
+             upOffset[0] == 0 && upOffset[n] == header.upCount;
+    for(int i = 0; ok && i < header.upCount; i++)
+        if(upTarget[i] < 0 || upTarget[i] >= n) ok = 0;
+    fclose(f);
+    
+    if(!ok) {
+        free(rank); free(upOffset); free(upTarget); free(upWeight);
+        return 0;
+    }
+    
+    free(sim->chRank); free(sim->chUpOffset); free(sim->chUpTarget); free(sim->chUpWeight);
+    sim->chRank = rank;
+    sim->chUpOffset = upOffset;
+    sim->chUpTarget = upTarget;
+    sim->chUpWeight = upWeight;
+    sim->chUpCount = header.upCount;
+    return 1;
+}
+
+void allocateHierarchyQuery() {
+    int n = sim->locationCount;
+    free(sim->chBackDist);
+    free(sim->chBackTouched);
+    sim->chBackDist = malloc(n * sizeof(int));
+    sim->chBackTouched = malloc(n * sizeof(int));
+    if(!sim->chBackDist || !sim->chBackTouched) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    for(int v = 0; v < n; v++) sim->chBackDist[v] = 99999;
+    sim->chBackTouchedCount = 0;
+    sim->chValid = 1;
+}
+
+// Loads the hierarchy from chFile when it matches the current roads,
+// otherwise contracts the graph (and saves it there for next time)
+void prepareContractionHierarchy() {
+    if(!sim->chFile || !loadContractionHierarchy(sim->chFile)) {
+        buildContractionHierarchy();
+        if(sim->chFile && !saveContractionHierarchy(sim->chFile))
+            fprintf(stderr, "Could not write contraction hierarchy to %s\n", sim->chFile);
+    }
+    allocateHierarchyQuery();
+}
+
+// Settles one node of one direction of the bidirectional search. dist
+// and other are this side's and the opposite side's distances.
+void chSettle(NodeHeap* heap, int* dist, const int* other, int isForward, int* best) {
+    HeapNode h = nodeHeapPop(heap);
+    if(h.dist > dist[h.node]) return;
+    sim->stats.shortestPathSettled++;
+    
+    if(other[h.node] < 99999 && h.dist + other[h.node] < *best)
+        *best = h.dist + other[h.node];
+    
+    // Stall-on-demand: a higher node already reached by a shorter way
+    // proves this label is not a shortest distance, so don't expand it
+    for(int e = sim->chUpOffset[h.node]; e < sim->chUpOffset[h.node + 1]; e++)
+        if(dist[sim->chUpTarget[e]] + sim->chUpWeight[e] < h.dist) return;
+    
+    for(int e = sim->chUpOffset[h.node]; e < sim->chUpOffset[h.node + 1]; e++) {
+        int v = sim->chUpTarget[e];
+        int newDist = h.dist + sim->chUpWeight[e];
+        if(newDist < dist[v]) {
+            if(isForward) scratchTouch(v);
+            else if(dist[v] == 99999) sim->chBackTouched[sim->chBackTouchedCount++] = v;
+            dist[v] = newDist;
+            nodeHeapPush(heap, newDist, v);
+        }
+    }
+}
+
+// Bidirectional upward search; each side stops once its smallest key
+// cannot improve the best meeting point found
+int chDistance(int from, int to) {
+    if(!sim->chValid) prepareContractionHierarchy();
+    if(from == to) return 0;
+    
+    int* forward = sim->scratchDist;
+    int* backward = sim->chBackDist;
+    scratchTouch(from);
+    forward[from] = 0;
+    backward[to] = 0;
+    sim->chBackTouched[sim->chBackTouchedCount++] = to;
+    
+    sim->pathHeap.size = 0;
+    sim->chBackHeap.size = 0;
+    nodeHeapPush(&sim->pathHeap, 0, from);
+    nodeHeapPush(&sim->chBackHeap, 0, to);
+    
+    int best = 99999;
+    while(1) {
+        int minForward = sim->pathHeap.size > 0 ? sim->pathHeap.items[0].dist : 99999;
+        int minBackward = sim->chBackHeap.size > 0 ? sim->chBackHeap.items[0].dist : 99999;
+        if(minForward >= best && minBackward >= best) break;
+        
+        if(minForward <= minBackward) chSettle(&sim->pathHeap, forward, backward, 1, &best);
+        else chSettle(&sim->chBackHeap, backward, forward, 0, &best);
+    }
+    
+    scratchReset();
+    for(int i = 0; i < sim->chBackTouchedCount; i++)
+        backward[sim->chBackTouched[i]] = 99999;
+    sim->chBackTouchedCount = 0;
+    return best;
+}
+
+
+//Spatial Index
+
+// Dispatch only runs exact route queries for units and hospitals whose
+// straight-line lower bound could still beat the best route found so
+// far. Grids hold every unit and hospital and are rebuilt lazily after
+// the map, fleet or hospital list changes.
+void initSpatialGrid(SpatialGrid* g, int items) {
+    freeSpatialGrid(g);
+    
+    int minX = 0, minY = 0, maxX = 0, maxY = 0;
+    for(int i = 0; i < sim->locationCount; i++) {
+        Location* l = &sim->locations[i];
+        if(i == 0 || l->x < minX) minX = l->x;
+        if(i == 0 || l->y < minY) minY = l->y;
+        if(i == 0 || l->x > maxX) maxX = l->x;
+        if(i == 0 || l->y > maxY) maxY = l->y;
+    }
+    
+    // About two items per cell along the longer side's square
+    int side = (int)ceil(sqrt(items / 2.0));
+    int span = (maxX - minX > maxY - minY ? maxX - minX : maxY - minY) + 1;
+    g->minX = minX;
+    g->minY = minY;
+    g->cellSize = side > 0 ? (span + side - 1) / side : span;
+    if(g->cellSize < 1) g->cellSize = 1;
+    g->cols = (maxX - minX) / g->cellSize + 1;
+    g->rows = (maxY - minY) / g->cellSize + 1;
+    
+    g->head = malloc((size_t)g->cols * g->rows * sizeof(int));
+    g->next = malloc((items + 1) * sizeof(int));
+    g->prev = malloc((items + 1) * sizeof(int));
+    g->cell = malloc((items + 1) * sizeof(int));
+    if(!g->head || !g->next || !g->prev || !g->cell) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    for(int c = 0; c < g->cols * g->rows; c++) g->head[c] = -1;
+}
+
+int gridCellX(const SpatialGrid* g, int loc) {
+    return (sim->locations[loc].x - g->minX) / g->cellSize;
+}
+
+int gridCellY(const SpatialGrid* g, int loc) {
+    return (sim->locations[loc].y - g->minY) / g->cellSize;
+}
+
+void gridInsert(SpatialGrid* g, int item, int loc) {
+    int c = gridCellY(g, loc) * g->cols + gridCellX(g, loc);
+    g->cell[item] = c;
+    g->prev[item] = -1;
+    g->next[item] = g->head[c];
+    if(g->head[c] != -1) g->prev[g->head[c]] = item;
+    g->head[c] = item;
+}
+
+void gridRemove(SpatialGrid* g, int item) {
+    if(g->prev[item] != -1) g->next[g->prev[item]] = g->next[item];
+    else g->head[g->cell[item]] = g->next[item];
+    if(g->next[item] != -1) g->prev[g->next[item]] = g->prev[item];
+}
+
+// Appends the items in the cells exactly `ring` cells away (Chebyshev)
+// from loc's cell. Returns how many, or -1 once the ring lies wholly
+// outside the grid.
+int gridRing(const SpatialGrid* g, int loc, int ring, int out[]) {
+    int cx = gridCellX(g, loc), cy = gridCellY(g, loc);
+    if(cx - ring < 0 && cy - ring < 0 && cx + ring >= g->cols && cy + ring >= g->rows)
+        return -1;
+    
+    int count = 0;
+    for(int y = cy - ring; y <= cy + ring; y++) {
+        if(y < 0 || y >= g->rows) continue;
+        int step = (y == cy - ring || y == cy + ring) ? 1 : 2 * ring;
+        for(int x = cx - ring; x <= cx + ring; x += step) {
+            if(x < 0 || x >= g->cols) continue;
+            for(int item = g->head[y * g->cols + x]; item != -1; item = g->next[item])
+                out[count++] = item;
+        }
+    }
+    return count;
+}
+
+// Lower bound on route minutes to anything in ring `ring` or beyond
+double ringLowerBound(const SpatialGrid* g, int ring) {
+    return ring <= 1 ? 0 : (ring - 1) * g->cellSize * sim->minutesPerUnit;
+}
+
+// Usable once the map has coordinates that bound its road times
+int spatialReady() {
+    if(!sim->csrValid) buildRoadGraph();
+    if(sim->minutesPerUnit <= 0) return 0;
+    if(sim->spatialValid) return 1;
+    
+    initSpatialGrid(&sim->unitGrid, sim->ambulanceCount);
+    for(int i = 0; i < sim->ambulanceCount; i++)
+        gridInsert(&sim->unitGrid, i, sim->unitLocation[i]);
+    
+    initSpatialGrid(&sim->hospitalGrid, sim->hospitalCount);
+    for(int i = 0; i < sim->hospitalCount; i++)
+        gridInsert(&sim->hospitalGrid, i, sim->hospitals[i].location);
+    
+    int items = sim->ambulanceCount > sim->hospitalCount ? sim->ambulanceCount : sim->hospitalCount;
+    sim->spatialCandidates = realloc(sim->spatialCandidates, (items + 1) * sizeof(int));
+    if(!sim->spatialCandidates) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    sim->spatialValid = 1;
+    return 1;
+}
+
+void moveAmbulance(int ambIndex, int loc) {
+    sim->unitLocation[ambIndex] = loc;
+    noteChange(&sim->changedUnits, ambIndex);
+    if(!sim->spatialValid) return;
+    gridRemove(&sim->unitGrid, ambIndex);
+    gridInsert(&sim->unitGrid, ambIndex, loc);
+}
+
+
+//Priority Calculation & Best Hospital selection
+
+int calculatePriority(DiseaseType disease, int age) {
+    int priority = disease * 3;
+    if(disease == CARDIAC && age >= 60) priority += 3;
+    if(disease == RESPIRATORY && (age <= 10 || age >= 60)) priority += 2;
+    return priority;
+}
+
+int getDynamicServiceTime(DiseaseType disease, int age) {
+    int baseTime = MIN_SERVICE_TIME + (simRandom() % (MAX_SERVICE_TIME - MIN_SERVICE_TIME + 1));
+    
+    if(disease == TRAUMA) baseTime += 2;
+    if(disease == CARDIAC && age >= 60) baseTime += 1;
+    if(age >= 80) baseTime += 1;
+    
+    return baseTime;
+}
+
+// Ring search outward from the scene; a hospital is routed to only if
+// its bound, specialty bonus included, can still match the best score.
+// Ties go to the lower index, as in the full scan.
+int findBestHospitalSpatial(int emergencyLoc, DiseaseType disease) {
+    int best = -1, bestScore = 99999;
+    int* ring = sim->spatialCandidates;
+    
+    for(int r = 0; 10 * ringLowerBound(&sim->hospitalGrid, r) - 50 <= bestScore; r++) {
+        int count = gridRing(&sim->hospitalGrid, emergencyLoc, r, ring);
+        if(count < 0) break;
+        
+        for(int k = 0; k < count; k++) {
+            int i = ring[k];
+            if(sim->hospitals[i].patients >= sim->hospitals[i].capacity) continue;
+            
+            int bonus = sim->hospitals[i].specialty == disease ? 50 : 0;
+            if(10 * routeLowerBound(emergencyLoc, sim->hospitals[i].location) - bonus > bestScore)
+                continue;
+            
+            int score = findShortestPath(emergencyLoc, sim->hospitals[i].location) * 10 - bonus;
+            if(score < bestScore || (score == bestScore && i < best)) {
+                bestScore = score;
+                best = i;
+            }
+        }
+    }
+    return best;
+}
+
+int findBestHospital(int emergencyLoc, DiseaseType disease) {
+    // With the distance matrix every route is a lookup; pruning only
+    // pays when each one is a search
+    if(sim->locationCount > DIST_MATRIX_MAX_LOCATIONS && spatialReady())
+        return findBestHospitalSpatial(emergencyLoc, disease);
+    
+    int best = -1, bestScore = 99999;
+    
+    for(int i = 0; i < sim->hospitalCount; i++) {
+        if(sim->hospitals[i].patients >= sim->hospitals[i].capacity) continue;
+        
+        int distance = findShortestPath(emergencyLoc, sim->hospitals[i].location);
+        int score = distance * 10;
+        if(sim->hospitals[i].specialty == disease) score -= 50;
+        
+        if(score < bestScore) {
+            bestScore = score;
+            best = i;
+        }
+    }
+    return best;
+}
+
+
+//Priority Queue (Max-Heap)
+
+
+int agingKey(int priority, int reportTime) {
+    return priority - WAIT_TIME_WEIGHT * reportTime;
+}
+
+int effectivePriority(const Emergency* e) {
+    return e->priority + WAIT_TIME_WEIGHT * (sim->currentTime - e->reportTime);
+}
+
+// Higher key first; equal keys are served in call order
+int queueBefore(QueueKey a, QueueKey b) {
+    return a.key > b.key || (a.key == b.key && a.id < b.id);
+}
+
+void heapSet(int i, QueueKey key) {
+    sim->pendingHeap[i] = key;
+    sim->pendingPos[key.slot] = i;
+}
+
+void heapSiftUp(int i) {
+    QueueKey key = sim->pendingHeap[i];
+    while(i > 0 && queueBefore(key, sim->pendingHeap[(i-1)/2])) {
+        heapSet(i, sim->pendingHeap[(i-1)/2]);
+        i = (i-1)/2;
+    }
+    heapSet(i, key);
+}
+
+void heapSiftDown(int i) {
+    while(1) {
+        int left = 2*i + 1;
+        int right = 2*i + 2;
+        int largest = i;
+        
+        if(left < sim->queueSize && queueBefore(sim->pendingHeap[left], sim->pendingHeap[largest]))
+            largest = left;
+        if(right < sim->queueSize && queueBefore(sim->pendingHeap[right], sim->pendingHeap[largest]))
+            largest = right;
+        
+        if(largest == i) break;
+        QueueKey temp = sim->pendingHeap[i];
+        heapSet(i, sim->pendingHeap[largest]);
+        heapSet(largest, temp);
+        i = largest;
+    }
+}
+
+// Moves entry i up or down after its key changed from `old`
+void heapFix(int i, QueueKey old) {
+    if(queueBefore(sim->pendingHeap[i], old)) heapSiftUp(i);
+    else heapSiftDown(i);
+}
+
+// Removes heap entry i and releases its record slot; the caller copies
+// the record out first if it still needs it.
+void heapRemoveAt(int i) {
+    int slot = sim->pendingHeap[i].slot;
+    idMapRemove(&sim->pendingIndex, sim->pendingRecords[slot].id);
+    noteChange(&sim->changedEmergencies, sim->pendingRecords[slot].id);
+    sim->freePendingSlots[sim->freePendingCount++] = slot;
+    
+    QueueKey last = sim->pendingHeap[--sim->queueSize];
+    if(i == sim->queueSize) return;
+    
+    QueueKey old = sim->pendingHeap[i];
+    heapSet(i, last);
+    heapFix(i, old);
+}
+
+// i-th entry in heap order (0 is the next call to be served)
+Emergency* pendingAt(int i) {
+    return &sim->pendingRecords[sim->pendingHeap[i].slot];
+}
+
+void enqueueEmergency(const char* caller, int loc, DiseaseType disease, int age) {
+    reservePending(sim->queueSize + 1);
+    
+    int slot = sim->freePendingCount > 0 ? sim->freePendingSlots[--sim->freePendingCount] : sim->pendingSlotCount++;
+    Emergency* e = &sim->pendingRecords[slot];
+    e->id = sim->nextEmergencyId++;
+    snprintf(e->caller, sizeof(e->caller), "%s", caller);
+    e->location = loc;
+    e->disease = disease;
+    e->age = age;
+    e->priority = calculatePriority(disease, age);
+    e->assignedAmbulance = -1;
+    e->canReassign = 1;
+    e->reportTime = sim->currentTime;
+    e->serviceTime = getDynamicServiceTime(disease, age);
+    journalCall(e);
+    
+    idMapPut(&sim->pendingIndex, e->id, slot);
+    noteChange(&sim->changedEmergencies, e->id);
+    
+    QueueKey key = { agingKey(e->priority, e->reportTime), e->id, slot };
+    sim->pendingHeap[sim->queueSize] = key;
+    heapSiftUp(sim->queueSize++);
+}
+
+Emergency dequeueEmergency() {
+    Emergency top = *pendingAt(0);
+    heapRemoveAt(0);
+    return top;
+}
+
+// Changes the base priority of a waiting call in O(log n). Returns 0 if
+// the id is not in the pending queue.
+int updateEmergencyPriority(int emergencyId, int priority) {
+    int slot = idMapGet(&sim->pendingIndex, emergencyId);
+    if(slot == -1) return 0;
+    
+    int i = sim->pendingPos[slot];
+    QueueKey old = sim->pendingHeap[i];
+    sim->pendingRecords[slot].priority = priority;
+    sim->pendingHeap[i].key = agingKey(priority, sim->pendingRecords[slot].reportTime);
+    heapFix(i, old);
+    noteChange(&sim->changedEmergencies, emergencyId);
+    return 1;
+}
+
+// Drops a waiting call (e.g. caller hung up). Returns 0 if not pending.
+int cancelEmergency(int emergencyId) {
+    int slot = idMapGet(&sim->pendingIndex, emergencyId);
+    if(slot == -1) return 0;
+    
+    heapRemoveAt(sim->pendingPos[slot]);
+    return 1;
+}
+
+
+//Fleet Scans
+
+// State bytes are compared 16 at a time (SSE2 is baseline on x86-64);
+// other targets, and the tail past the last full vector, use the plain
+// loop. Transitions themselves come off the timer heap, so these only
+// serve the whole-fleet questions: how many units are idle, and which.
+int countUnitsInState(AmbulanceState state) {
+    int n = sim->ambulanceCount, count = 0, i = 0;
+#ifdef __SSE2__
+    __m128i want = _mm_set1_epi8((char)state);
+    for(; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)&sim->unitState[i]);
+        count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v, want)));
+    }
+#endif
+    for(; i < n; i++) count += sim->unitState[i] == state;
+    return count;
+}
+
+// Indices of up to `limit` units in `state`, ascending. Returns how many.
+int collectUnitsInState(AmbulanceState state, int out[], int limit) {
+    int n = sim->ambulanceCount, count = 0, i = 0;
+#ifdef __SSE2__
+    __m128i want = _mm_set1_epi8((char)state);
+    for(; i + 16 <= n && count < limit; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)&sim->unitState[i]);
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, want));
+        while(mask && count < limit) {
+            out[count++] = i + __builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+    }
+#endif
+    for(; i < n && count < limit; i++)
+        if(sim->unitState[i] == state) out[count++] = i;
+    return count;
+}
+
+
+//Active Emergencies
+
+// Records sit in fixed-size pages that never move, so an Emergency*
+// stays valid until that call itself is removed. activeList keeps the
+// live slots dense for iteration, activePos maps a slot back to its
+// list index and activeIndex maps an id to its slot.
+Emergency* activeSlot(int slot) {
+    return &sim->activePages[slot / ACTIVE_PAGE_SIZE][slot % ACTIVE_PAGE_SIZE];
+}
+
+// i-th active call, 0 <= i < activeCount
+Emergency* activeAt(int i) {
+    return activeSlot(sim->activeList[i]);
+}
+
+Emergency* findActiveEmergency(int emergencyId) {
+    int slot = idMapGet(&sim->activeIndex, emergencyId);
+    return slot == -1 ? NULL : activeSlot(slot);
+}
+
+Emergency* addActiveEmergency(const Emergency* e) {
+    reserveActive(sim->activeCount + 1);
+    
+    int slot = sim->freeActiveCount > 0 ? sim->freeActiveSlots[--sim->freeActiveCount] : sim->activeSlotCount++;
+    *activeSlot(slot) = *e;
+    sim->activePos[slot] = sim->activeCount;
+    sim->activeList[sim->activeCount++] = slot;
+    idMapPut(&sim->activeIndex, e->id, slot);
+    noteChange(&sim->changedEmergencies, e->id);
+    return activeSlot(slot);
+}
+
+// Swap-removes the call from the list, so the remaining calls keep the
+// order the old array gave them. Returns 0 if the id is not active.
+int removeActiveEmergency(int emergencyId) {
+    int slot = idMapGet(&sim->activeIndex, emergencyId);
+    if(slot == -1) return 0;
+    
+    idMapRemove(&sim->activeIndex, emergencyId);
+    noteChange(&sim->changedEmergencies, emergencyId);
+    int i = sim->activePos[slot];
+    int last = sim->activeList[--sim->activeCount];
+    sim->activeList[i] = last;
+    sim->activePos[last] = i;
+    sim->freeActiveSlots[sim->freeActiveCount++] = slot;
+    return 1;
+}
+
+
+//Ambulance State Tracking 
+
+
+// One multi-source Dijkstra seeded at the given idle units (every idle
+// unit if units is NULL); each node remembers which unit reached it
+// first (lowest index on ties, as the old per-unit scan did). Stops once
+// the emergency location is settled and returns that unit, with its
+// travel time in *eta.
+int nearestFromUnits(const int units[], int count, int emergencyLoc, int* eta) {
+    int* distance = sim->scratchDist;
+    int* owner = sim->scratchOwner;
+    
+    if(!sim->csrValid) buildRoadGraph();
+    int depart = trafficDeparture();
+    
+    if(!units) {
+        count = collectUnitsInState(IDLE, sim->idleUnits, sim->ambulanceCount);
+        units = sim->idleUnits;
+    }
+    
+    sim->pathHeap.size = 0;
+    for(int k = 0; k < count; k++) {
+        int i = units[k];
+        if(sim->unitState[i] != IDLE) continue;
+        int loc = sim->unitLocation[i];
+        if(owner[loc] == -1) {
+            scratchTouch(loc);
+            distance[loc] = 0;
+            owner[loc] = i;
+            nodeHeapPush(&sim->pathHeap, 0, loc);
+        }
+        else if(i < owner[loc]) owner[loc] = i;
+    }
+    
+    while(sim->pathHeap.size > 0) {
+        HeapNode h = nodeHeapPop(&sim->pathHeap);
+        if(h.dist > distance[h.node]) continue;
+        if(h.dist > distance[emergencyLoc]) break;
+        
+        for(int e = sim->csrOffset[h.node]; e < sim->csrOffset[h.node + 1]; e++) {
+            int v = sim->csrTarget[e];
+            int newDist = h.dist + roadMinutes(e, depart + h.dist);
+            if(newDist < distance[v] || (newDist == distance[v] && owner[h.node] < owner[v])) {
+                scratchTouch(v);
+                distance[v] = newDist;
+                owner[v] = owner[h.node];
+                nodeHeapPush(&sim->pathHeap, newDist, v);
+            }
+        }
+    }
+    
+    int nearest = owner[emergencyLoc];
+    if(eta) *eta = distance[emergencyLoc];
+    scratchReset();
+    return nearest;
+}
+
+// Searches from the few idle units closest in a straight line, then
+// adds every unit whose lower bound does not exceed the ETA found and
+// searches again if there were any. Units left out cannot be closer
+// (or tie), so the answer matches a search from the whole fleet.
+int findNearestIdleAmbulanceETA(int emergencyLoc, int* eta) {
+    sim->stats.nearestUnitSearches++;
+    if(sim->idleAmbulances <= SPATIAL_CANDIDATES || !spatialReady())
+        return nearestFromUnits(NULL, 0, emergencyLoc, eta);
+    
+    int* candidates = sim->spatialCandidates;
+    int count = 0, ring = 0, found;
+    while(count < SPATIAL_CANDIDATES &&
+          (found = gridRing(&sim->unitGrid, emergencyLoc, ring, &candidates[count])) >= 0) {
+        int end = count + found;
+        for(int k = count; k < end; k++)
+            if(sim->unitState[candidates[k]] == IDLE) candidates[count++] = candidates[k];
+        ring++;
+    }
+    
+    int bestETA;
+    int nearest = nearestFromUnits(candidates, count, emergencyLoc, &bestETA);
+    
+    int before = count;
+    while(ringLowerBound(&sim->unitGrid, ring) <= bestETA &&
+          (found = gridRing(&sim->unitGrid, emergencyLoc, ring, &candidates[count])) >= 0) {
+        int end = count + found;
+        for(int k = count; k < end; k++) {
+            int i = candidates[k];
+            if(sim->unitState[i] == IDLE &&
+               routeLowerBound(sim->unitLocation[i], emergencyLoc) <= bestETA)
+                candidates[count++] = i;
+        }
+        ring++;
+    }
+    if(count > before) nearest = nearestFromUnits(candidates, count, emergencyLoc, &bestETA);
+    
+    if(eta) *eta = bestETA;
+    return nearest;
+}
+
+int findNearestIdleAmbulance(int emergencyLoc) {
+    return findNearestIdleAmbulanceETA(emergencyLoc, NULL);
+}
+
+void checkReassignmentOpportunities(int unit);
+
+void setAmbulanceState(int ambIndex, AmbulanceState state) {
+    if(sim->unitState[ambIndex] == IDLE) sim->idleAmbulances--;
+    if(state == IDLE) sim->idleAmbulances++;
+    sim->unitState[ambIndex] = state;
+    noteChange(&sim->changedUnits, ambIndex);
+}
+
+
+//Event Scheduler
+
+// Min-heap of pending ambulance transitions keyed on (time, unit).
+// Rescheduling a unit bumps its timerVersion, which turns any older
+// entry for it into a tombstone that is skipped when popped.
+int timerBefore(TimerEvent a, TimerEvent b) {
+    return a.time < b.time || (a.time == b.time && a.ambulance < b.ambulance);
+}
+
+void timerPush(TimerEvent ev) {
+    sim->timerHeap = reserveArray(sim->timerHeap, &sim->timerCap, sim->timerCount + 1, sizeof(TimerEvent));
+    int i = sim->timerCount++;
+    while(i > 0 && timerBefore(ev, sim->timerHeap[(i-1)/2])) {
+        sim->timerHeap[i] = sim->timerHeap[(i-1)/2];
+        i = (i-1)/2;
+    }
+    sim->timerHeap[i] = ev;
+}
+
+TimerEvent timerPop() {
+    TimerEvent top = sim->timerHeap[0];
+    TimerEvent last = sim->timerHeap[--sim->timerCount];
+    
+    int i = 0;
+    while(1) {
+        int child = 2*i + 1;
+        if(child >= sim->timerCount) break;
+        if(child + 1 < sim->timerCount && timerBefore(sim->timerHeap[child + 1], sim->timerHeap[child]))
+            child++;
+        if(!timerBefore(sim->timerHeap[child], last)) break;
+        sim->timerHeap[i] = sim->timerHeap[child];
+        i = child;
+    }
+    if(sim->timerCount > 0) sim->timerHeap[i] = last;
+    
+    return top;
+}
+
+// Drops tombstones off the top so timerHeap[0] is a live event
+void timerSkipStale() {
+    while(sim->timerCount > 0) {
+        TimerEvent top = sim->timerHeap[0];
+        if(top.version == sim->ambulances[top.ambulance].timerVersion && sim->unitState[top.ambulance] != IDLE) break;
+        timerPop();
+    }
+}
+
+// Schedules the unit's next transition at its availableAt. A transition
+// never fires earlier than the minute in which the old per-minute scan
+// would have reached the unit.
+void scheduleAmbulance(int ambIndex) {
+    Ambulance* a = &sim->ambulances[ambIndex];
+    int earliest = ambIndex > sim->timerCursor ? sim->currentTime : sim->currentTime + 1;
+    
+    TimerEvent ev;
+    int due = sim->unitAvailableAt[ambIndex];
+    ev.time = due > earliest ? due : earliest;
+    ev.ambulance = ambIndex;
+    ev.version = ++a->timerVersion;
+    timerPush(ev);
+    noteChange(&sim->changedUnits, ambIndex);
+}
+
+// Where a travelling unit is headed, or -1 when it is not travelling
+int legDestination(int i) {
+    const Ambulance* a = &sim->ambulances[i];
+    if(sim->unitState[i] == TO_EMERGENCY) {
+        const Emergency* e = findActiveEmergency(a->targetEmergency);
+        return e ? e->location : -1;
+    }
+    if(sim->unitState[i] == TO_HOSPITAL) return sim->hospitals[a->targetHospital].location;
+    if(sim->unitState[i] == RETURNING) return sim->hospitals[a->baseHospital].location;
+    return -1;
+}
+
+// Moves the unit's arrival to `at`. A call's response time is counted
+// as its unit's expected arrival, so that moves with it.
+void setArrival(int i, int at) {
+    sim->unitAvailableAt[i] = at;
+    if(sim->unitState[i] == TO_EMERGENCY) {
+        sim->totalResponseTime += at - sim->ambulances[i].estimatedArrival;
+        sim->ambulances[i].estimatedArrival = at;
+    }
+}
+
+// Starts the leg to legDestination from the unit's location. Returns
+// its minutes, or -1 if closures cut the destination off: the unit then
+// waits and tries again next minute rather than being timed on the
+// 99999 sentinel.
+int beginLeg(int i) {
+    int dest = legDestination(i);
+    int d = dest == -1 ? 0 : findShortestPath(sim->unitLocation[i], dest);
+    if(d >= 99999) {
+        sim->ambulances[i].legStart = -1;
+        setArrival(i, sim->currentTime + 1);
+        return -1;
+    }
+    sim->ambulances[i].legStart = sim->currentTime;
+    setArrival(i, sim->currentTime + d);
+    return d;
+}
+
+// After a closure or reopening, re-times every leg under way on the new
+// roads. Positions along a road are not tracked, so a leg keeps its
+// start and takes the best route from there, never arriving before now;
+// one that lost its only route waits like beginLeg's.
+void retimeLegs() {
+    for(int i = 0; i < sim->ambulanceCount; i++) {
+        if(sim->ambulances[i].legStart == -1) continue;
+        int dest = legDestination(i);
+        if(dest == -1) continue;
+        
+        int d = findShortestPath(sim->unitLocation[i], dest);
+        int at = sim->ambulances[i].legStart + d;
+        if(d >= 99999) {
+            beginLeg(i);
+            simLog(LOG_WARN, "  [Time %d] Unit-%d cut off by a closure, waiting for an open route\n",
+                   sim->currentTime, sim->ambulances[i].id);
+        }
+        else if(at < sim->currentTime) setArrival(i, sim->currentTime);
+        else if(at != sim->unitAvailableAt[i]) setArrival(i, at);
+        else continue;
+        scheduleAmbulance(i);
+    }
+}
+
+void handleAmbulanceEvent(int i) {
+    // Still cut off: try the same leg again
+    if(sim->ambulances[i].legStart == -1 && legDestination(i) != -1) {
+        int d = beginLeg(i);
+        if(d >= 0)
+            simLog(LOG_INFO, "  [Time %d] Unit-%d found an open route (%d min)\n",
+                   sim->currentTime, sim->ambulances[i].id, d);
+        return;
+    }
+    
+    if(sim->unitState[i] == TO_EMERGENCY) {
+        setAmbulanceState(i, AT_SCENE);
+        
+        Emergency* e = findActiveEmergency(sim->ambulances[i].targetEmergency);
+        if(e) {
+            moveAmbulance(i, e->location);
+            sim->unitAvailableAt[i] = sim->currentTime + e->serviceTime;
+            e->canReassign = 0;
+            noteChange(&sim->changedEmergencies, e->id);
+            
+            int delay = sim->currentTime - e->reportTime;
+            sim->responseMinutes[delay < RESPONSE_HIST_SIZE ? delay : RESPONSE_HIST_SIZE - 1]++;
+            histRecord(&sim->stats.responseByDisease[e->disease], delay);
+            journalEvent(JOURNAL_ARRIVE, i, e->id, e->serviceTime, 0);
+            simLog(LOG_INFO, "  [Time %d] Unit-%d arrived at scene (service time: %d min)\n", 
+                   sim->currentTime, sim->ambulances[i].id, e->serviceTime);
+        }
+    }
+    else if(sim->unitState[i] == AT_SCENE) {
+        setAmbulanceState(i, TO_HOSPITAL);
+        int dist = beginLeg(i);
+        journalEvent(JOURNAL_TRANSPORT, i, sim->ambulances[i].targetHospital, dist, 0);
+        if(dist >= 0)
+            simLog(LOG_INFO, "  [Time %d] Unit-%d transporting to %s (ETA: %d min)\n", 
+                   sim->currentTime, sim->ambulances[i].id, 
+                   sim->hospitals[sim->ambulances[i].targetHospital].name, dist);
+        else
+            simLog(LOG_WARN, "  [Time %d] Unit-%d waiting at scene for an open route to %s\n",
+                   sim->currentTime, sim->ambulances[i].id,
+                   sim->hospitals[sim->ambulances[i].targetHospital].name);
+    }
+    else if(sim->unitState[i] == TO_HOSPITAL) {
+        setAmbulanceState(i, RETURNING);
+        moveAmbulance(i, sim->hospitals[sim->ambulances[i].targetHospital].location);
+        
+        if(removeActiveEmergency(sim->ambulances[i].targetEmergency))
+            sim->totalHandled++;
+        
+        int returnDist = beginLeg(i);
+        journalEvent(JOURNAL_DELIVER, i, sim->ambulances[i].targetEmergency, returnDist, 0);
+        
+        if(returnDist >= 0)
+            simLog(LOG_INFO, "  [Time %d] Unit-%d delivered patient, returning to base (%d min)\n", 
+                   sim->currentTime, sim->ambulances[i].id, returnDist);
+        else
+            simLog(LOG_WARN, "  [Time %d] Unit-%d delivered patient, waiting for an open route to base\n",
+                   sim->currentTime, sim->ambulances[i].id);
+        
+        sim->ambulances[i].targetEmergency = -1;
+        sim->ambulances[i].targetHospital = -1;
+    }
+    else if(sim->unitState[i] == RETURNING) {
+        setAmbulanceState(i, IDLE);
+        moveAmbulance(i, sim->hospitals[sim->ambulances[i].baseHospital].location);
+        journalEvent(JOURNAL_IDLE, i, 0, 0, 0);
+        simLog(LOG_INFO, "  [Time %d] Unit-%d back at base and available\n", 
+               sim->currentTime, sim->ambulances[i].id);
+        
+        checkReassignmentOpportunities(i);
+    }
+}
+
+// Fires every transition due at currentTime, in unit order, touching
+// only the units that actually have something happening.
+void updateAmbulanceStates() {
+    while(1) {
+        timerSkipStale();
+        if(sim->timerCount == 0 || sim->timerHeap[0].time > sim->currentTime) break;
+        
+        int i = timerPop().ambulance;
+        sim->timerCursor = i;
+        handleAmbulanceEvent(i);
+        if(sim->unitState[i] != IDLE) scheduleAmbulance(i);
+    }
+    sim->timerCursor = INT_MAX;
+}
+
+
+//Dynamic Reassignment
+
+// Minutes from `from` to every node within `radius`, left in scratchDist
+// (99999 further out) until the caller's scratchReset(). Roads are
+// undirected, so this is also each node's distance to a unit at `from`.
+void searchWithin(int from, int radius) {
+    if(!sim->csrValid) buildRoadGraph();
+    int depart = trafficDeparture();
+    
+    int* distance = sim->scratchDist;
+    scratchTouch(from);
+    distance[from] = 0;
+    
+    sim->pathHeap.size = 0;
+    nodeHeapPush(&sim->pathHeap, 0, from);
+    
+    while(sim->pathHeap.size > 0) {
+        HeapNode h = nodeHeapPop(&sim->pathHeap);
+        if(h.dist > distance[h.node]) continue;
+        sim->stats.shortestPathSettled++;
+        
+        for(int e = sim->csrOffset[h.node]; e < sim->csrOffset[h.node + 1]; e++) {
+            int v = sim->csrTarget[e];
+            int newDist = h.dist + roadMinutes(e, depart + h.dist);
+            if(newDist <= radius && newDist < distance[v]) {
+                scratchTouch(v);
+                distance[v] = newDist;
+                nodeHeapPush(&sim->pathHeap, newDist, v);
+            }
+        }
+    }
+    sim->stats.shortestPathSearches++;
+}
+
+// Hands call e over to idle unit `unit`, `dist` minutes away. The call
+// keeps its hospital bed and its place in the stats; only the travel
+// time it saves comes off the response total.
+void reassignEmergency(Emergency* e, int unit, int dist) {
+    int oldUnit = e->assignedAmbulance;
+    int saved = sim->ambulances[oldUnit].estimatedArrival - (sim->currentTime + dist);
+    journalEvent(JOURNAL_REASSIGN, e->id, oldUnit, unit, dist);
+    
+    simLog(LOG_INFO, "\n  [REASSIGNMENT] Emergency #%d\n", e->id);
+    simLog(LOG_INFO, "     Old: Unit-%d (ETA %d) -> New: Unit-%d (ETA %d)\n",
+           oldUnit + 1, sim->ambulances[oldUnit].estimatedArrival - sim->currentTime,
+           unit + 1, dist);
+    simLog(LOG_INFO, "     Time saved: %d minutes\n", saved);
+    sim->stats.reassignments++;
+    sim->stats.reassignMinutesSaved += saved;
+    sim->totalResponseTime -= saved;
+    
+    setAmbulanceState(unit, TO_EMERGENCY);
+    sim->ambulances[unit].targetEmergency = e->id;
+    sim->ambulances[unit].targetHospital = sim->ambulances[oldUnit].targetHospital;
+    sim->ambulances[unit].estimatedArrival = sim->currentTime + dist;
+    beginLeg(unit);
+    scheduleAmbulance(unit);
+    
+    setAmbulanceState(oldUnit, IDLE);
+    sim->ambulances[oldUnit].targetEmergency = -1;
+    sim->ambulances[oldUnit].targetHospital = -1;
+    e->assignedAmbulance = unit;
+    noteChange(&sim->changedEmergencies, e->id);
+}
+
+// The reassignable call on which idle `unit` saves the most minutes, at
+// least REASSIGN_THRESHOLD, or NULL. Only calls the unit can reach in
+// time are looked at: one search from the unit, cut off at the largest
+// saving still possible, gives the distance to all of them at once.
+Emergency* bestReassignment(int unit, int* dist) {
+    int slack = -1;
+    for(int i = 0; i < sim->activeCount; i++) {
+        Emergency* e = activeAt(i);
+        if(!e->canReassign || e->assignedAmbulance == -1) continue;
+        int left = sim->ambulances[e->assignedAmbulance].estimatedArrival - sim->currentTime - REASSIGN_THRESHOLD;
+        if(left > slack) slack = left;
+    }
+    if(slack < 0) return NULL;
+    
+    // Small maps answer from the distance cache instead
+    int searched = sim->locationCount > DIST_MATRIX_MAX_LOCATIONS;
+    if(searched) searchWithin(sim->unitLocation[unit], slack);
+    
+    Emergency* best = NULL;
+    int bestSaved = REASSIGN_THRESHOLD - 1;
+    for(int i = 0; i < sim->activeCount; i++) {
+        Emergency* e = activeAt(i);
+        if(!e->canReassign || e->assignedAmbulance == -1) continue;
+        
+        int d = searched ? sim->scratchDist[e->location]
+                         : findShortestPath(sim->unitLocation[unit], e->location);
+        int saved = sim->ambulances[e->assignedAmbulance].estimatedArrival - (sim->currentTime + d);
+        if(d < 99999 && saved > bestSaved) {
+            best = e;
+            bestSaved = saved;
+            *dist = d;
+        }
+    }
+    if(searched) scratchReset();
+    return best;
+}
+
+// Called when `unit` becomes idle. Units that were already idle had their
+// chance at every current call when they freed up (and new calls go to
+// the nearest idle unit), so only pairs with this unit are new. Each
+// swap frees the call's old unit, which is then tried the same way.
+void checkReassignmentOpportunities(int unit) {
+    int dist;
+    Emergency* e;
+    while((e = bestReassignment(unit, &dist)) != NULL) {
+        int freed = e->assignedAmbulance;
+        reassignEmergency(e, unit, dist);
+        unit = freed;
+    }
+}
+
+void dispatchAmbulance(int ambIndex, Emergency emerg) {
+    int hospIndex = findBestHospital(emerg.location, emerg.disease);
+    
+    if(hospIndex == -1) {
+        journalEvent(JOURNAL_REQUEUE, emerg.id, 0, 0, 0);
+        enqueueEmergency(emerg.caller, emerg.location, emerg.disease, emerg.age);
+        sim->stats.requeues++;
+        simLog(LOG_WARN, "  [WARNING] No hospital available, emergency re-queued\n");
+        return;
+    }
+    
+    histRecord(&sim->stats.queueWaitMinutes, sim->currentTime - emerg.reportTime);
+    sim->stats.dispatches++;
+    
+    emerg.assignedAmbulance = ambIndex;
+    emerg.canReassign = 1;
+    addActiveEmergency(&emerg);
+    
+    // The leg adds the travel time to the response total
+    setAmbulanceState(ambIndex, TO_EMERGENCY);
+    sim->ambulances[ambIndex].targetEmergency = emerg.id;
+    sim->ambulances[ambIndex].targetHospital = hospIndex;
+    sim->ambulances[ambIndex].estimatedArrival = sim->currentTime;
+    int distToScene = beginLeg(ambIndex);
+    scheduleAmbulance(ambIndex);
+    journalEvent(JOURNAL_DISPATCH, ambIndex, emerg.id, hospIndex, distToScene);
+    
+    sim->hospitals[hospIndex].patients++;
+    noteChange(&sim->changedHospitals, hospIndex);
+    
+    simLog(LOG_INFO, "\n  [DISPATCH] Unit-%d dispatched to %s\n", ambIndex + 1, emerg.caller);
+    simLog(LOG_INFO, "  Location: %s\n", sim->locations[emerg.location].name);
+    simLog(LOG_INFO, "  Destination: %s\n", sim->hospitals[hospIndex].name);
+    if(distToScene >= 0) simLog(LOG_INFO, "  ETA: %d minutes\n", distToScene);
+    else simLog(LOG_WARN, "  No open route yet, unit waits\n");
+}
+
+//Batch Dispatch
+
+// Indices (into pendingHeap) of the k most urgent waiting calls, most
+// urgent first. Walks the heap best-first without modifying it.
+int collectTopPending(int k, int out[]) {
+    BatchScratch* b = &sim->batch;
+    b->frontier = reserveArray(b->frontier, &b->frontierCap, 2 * k + 1, sizeof(int));
+    int* frontier = b->frontier;
+    int frontierSize = 0, found = 0;
+    
+    if(sim->queueSize > 0) frontier[frontierSize++] = 0;
+    
+    while(found < k && frontierSize > 0) {
+        int best = 0;
+        for(int f = 1; f < frontierSize; f++)
+            if(queueBefore(sim->pendingHeap[frontier[f]], sim->pendingHeap[frontier[best]]))
+                best = f;
+        int i = frontier[best];
+        frontier[best] = frontier[--frontierSize];
+        out[found++] = i;
+        
+        if(2*i + 1 < sim->queueSize) frontier[frontierSize++] = 2*i + 1;
+        if(2*i + 2 < sim->queueSize) frontier[frontierSize++] = 2*i + 2;
+    }
+    
+    return found;
+}
+
+// Hungarian algorithm (shortest augmenting path, O(n^2 m)) for an n x m
+// cost matrix with n <= m. cost is row-major; rowMatch[r] receives the
+// column assigned to row r.
+void solveAssignment(int n, int m, const long* cost, int rowMatch[]) {
+    BatchScratch* b = &sim->batch;
+    b->rowPotential = reserveArray(b->rowPotential, &b->rowPotentialCap, n + 1, sizeof(long));
+    b->colPotential = reserveArray(b->colPotential, &b->colPotentialCap, m + 1, sizeof(long));
+    b->colMatch = reserveArray(b->colMatch, &b->colMatchCap, m + 1, sizeof(int));
+    b->way = reserveArray(b->way, &b->wayCap, m + 1, sizeof(int));
+    b->minv = reserveArray(b->minv, &b->minvCap, m + 1, sizeof(long));
+    b->used = reserveArray(b->used, &b->usedCap, m + 1, 1);
+    long* u = b->rowPotential;
+    long* v = b->colPotential;
+    int* colMatch = b->colMatch;
+    int* way = b->way;
+    long* minv = b->minv;
+    char* used = b->used;
+    memset(u, 0, (n + 1) * sizeof(long));
+    memset(v, 0, (m + 1) * sizeof(long));
+    memset(colMatch, 0, (m + 1) * sizeof(int));
+    memset(way, 0, (m + 1) * sizeof(int));
+    
+    for(int r = 1; r <= n; r++) {
+        colMatch[0] = r;
+        int c0 = 0;
+        for(int c = 0; c <= m; c++) {
+            minv[c] = LONG_MAX;
+            used[c] = 0;
+        }
+        
+        do {
+            used[c0] = 1;
+            int r0 = colMatch[c0], c1 = 0;
+            long delta = LONG_MAX;
+            for(int c = 1; c <= m; c++) {
+                if(used[c]) continue;
+                long cur = cost[(long)(r0 - 1) * m + (c - 1)] - u[r0] - v[c];
+                if(cur < minv[c]) {
+                    minv[c] = cur;
+                    way[c] = c0;
+                }
+                if(minv[c] < delta) {
+                    delta = minv[c];
+                    c1 = c;
+                }
+            }
+            for(int c = 0; c <= m; c++) {
+                if(used[c]) {
+                    u[colMatch[c]] += delta;
+                    v[c] -= delta;
+                } else {
+                    minv[c] -= delta;
+                }
+            }
+            c0 = c1;
+        } while(colMatch[c0] != 0);
+        
+        do {
+            int c1 = way[c0];
+            colMatch[c0] = colMatch[c1];
+            c0 = c1;
+        } while(c0);
+    }
+    
+    for(int c = 1; c <= m; c++)
+        if(colMatch[c]) rowMatch[colMatch[c] - 1] = c - 1;
+}
+
+// Travel minutes the one-call-at-a-time greedy rule would spend serving
+// the calls the batch served (unitForCall != -1) with the same units:
+// most urgent call first, nearest free unit. -1 if greedy leaves one of
+// them unserved, since the totals would then cover different calls.
+long greedyAssignmentCost(int calls, int units, const int* dist, const int* unitForCall) {
+    BatchScratch* b = &sim->batch;
+    b->taken = reserveArray(b->taken, &b->takenCap, units, 1);
+    char* taken = b->taken;
+    memset(taken, 0, units);
+    long total = 0;
+    
+    for(int c = 0; c < calls; c++) {
+        if(unitForCall[c] == -1) continue;
+        int best = -1;
+        for(int u = 0; u < units; u++) {
+            if(taken[u] || dist[c * units + u] >= 99999) continue;
+            if(best == -1 || dist[c * units + u] < dist[c * units + best]) best = u;
+        }
+        if(best == -1) return -1;
+        taken[best] = 1;
+        total += dist[c * units + best];
+    }
+    
+    return total;
+}
+
+// Assigns waiting calls to idle units in one step, minimising total
+// travel time minus BATCH_PRIORITY_WEIGHT * priority of the calls
+// served. When there are more calls than units, the weight decides which
+// calls go first; otherwise every call is served and the priority term
+// is constant, so the result is the minimum total travel time.
+void processQueueBatch() {
+    if(sim->queueSize == 0 || sim->idleAmbulances == 0) return;
+    
+    int calls = sim->queueSize < 2 * sim->idleAmbulances ? sim->queueSize : 2 * sim->idleAmbulances;
+    if(calls > BATCH_MAX_SIZE) calls = BATCH_MAX_SIZE;
+    
+    BatchScratch* b = &sim->batch;
+    b->heapIdx = reserveArray(b->heapIdx, &b->heapIdxCap, calls, sizeof(int));
+    int* heapIdx = b->heapIdx;
+    calls = collectTopPending(calls, heapIdx);
+    
+    b->unitIdx = reserveArray(b->unitIdx, &b->unitIdxCap, BATCH_MAX_SIZE, sizeof(int));
+    int* unitIdx = b->unitIdx;
+    int units = collectUnitsInState(IDLE, unitIdx, BATCH_MAX_SIZE);
+    
+    b->dist = reserveArray(b->dist, &b->distCap, calls * units, sizeof(int));
+    int* dist = b->dist;
+    for(int c = 0; c < calls; c++) {
+        int loc = sim->pendingRecords[sim->pendingHeap[heapIdx[c]].slot].location;
+        for(int u = 0; u < units; u++)
+            dist[c * units + u] = findShortestPath(sim->unitLocation[unitIdx[u]], loc);
+    }
+    
+    // Rows must be the smaller side for the solver
+    int rowsAreCalls = calls <= units;
+    int n = rowsAreCalls ? calls : units;
+    int m = rowsAreCalls ? units : calls;
+    b->cost = reserveArray(b->cost, &b->costCap, n * m, sizeof(long));
+    long* cost = b->cost;
+    for(int c = 0; c < calls; c++) {
+        long weight = (long)BATCH_PRIORITY_WEIGHT *
+                      effectivePriority(&sim->pendingRecords[sim->pendingHeap[heapIdx[c]].slot]);
+        for(int u = 0; u < units; u++) {
+            long d = dist[c * units + u];
+            long value = d >= 99999 ? 1000000000L : d - weight;
+            if(rowsAreCalls) cost[(long)c * m + u] = value;
+            else cost[(long)u * m + c] = value;
+        }
+    }
+    
+    b->rowMatch = reserveArray(b->rowMatch, &b->rowMatchCap, n, sizeof(int));
+    int* rowMatch = b->rowMatch;
+    solveAssignment(n, m, cost, rowMatch);
+    
+    b->unitForCall = reserveArray(b->unitForCall, &b->unitForCallCap, calls, sizeof(int));
+    int* unitForCall = b->unitForCall;
+    for(int c = 0; c < calls; c++) unitForCall[c] = -1;
+    for(int r = 0; r < n; r++) {
+        int c = rowsAreCalls ? r : rowMatch[r];
+        int u = rowsAreCalls ? rowMatch[r] : r;
+        if(dist[c * units + u] < 99999) unitForCall[c] = u;
+    }
+    
+    long optimal = 0;
+    int served = 0;
+    for(int c = 0; c < calls; c++) {
+        if(unitForCall[c] == -1) continue;
+        optimal += dist[c * units + unitForCall[c]];
+        served++;
+    }
+    long greedy = served > 0 ? greedyAssignmentCost(calls, units, dist, unitForCall) : -1;
+    if(greedy >= 0) {
+        sim->batchOptimalMinutes += optimal;
+        sim->batchGreedyMinutes += greedy;
+        sim->batchRounds++;
+    }
+    
+    // Take the records out before dispatching: a re-queued call would
+    // otherwise reuse slots and shift heap positions under us.
+    b->chosen = reserveArray(b->chosen, &b->chosenCap, calls, sizeof(Emergency));
+    Emergency* chosen = b->chosen;
+    for(int c = 0; c < calls; c++)
+        chosen[c] = sim->pendingRecords[sim->pendingHeap[heapIdx[c]].slot];
+    for(int c = 0; c < calls; c++) {
+        if(unitForCall[c] == -1) continue;
+        cancelEmergency(chosen[c].id);
+        dispatchAmbulance(unitIdx[unitForCall[c]], chosen[c]);
+    }
+}
+
+// Console switch for batch dispatch; journaled like any other input
+void setBatchDispatch(int on) {
+    sim->batchDispatch = on;
+    journalEvent(JOURNAL_BATCH, on, 0, 0, 0);
+}
+
+void processQueue() {
+    if(sim->queueSize == 0 || sim->idleAmbulances == 0) return;
+    
+    long start = monotonicNanos();
+    if(sim->batchDispatch) {
+        processQueueBatch();
+    } else {
+        int ambIndex = findNearestIdleAmbulance(pendingAt(0)->location);
+        if(ambIndex != -1) {
+            Emergency e = dequeueEmergency();
+            dispatchAmbulance(ambIndex, e);
+        }
+    }
+    recordElapsed(&sim->stats.dispatchNanos, start);
+}
+
+void simulateMinute() {
+    updateAmbulanceStates();
+    processQueue();
+    
+    if(sim->currentTime % 15 == 0) {
+        for(int j = 0; j < sim->hospitalCount; j++) {
+            if(sim->hospitals[j].patients > 0) {
+                sim->hospitals[j].patients--;
+                noteChange(&sim->changedHospitals, j);
+                journalEvent(JOURNAL_DISCHARGE, j, 0, 0, 0);
+                simLog(LOG_INFO, "  [Time %d] Patient discharged from %s\n", 
+                       sim->currentTime, sim->hospitals[j].name);
+            }
+        }
+    }
+}
+
+// Jumps straight from one interesting minute to the next: the next unit
+// transition, the next 15-minute discharge round, or every minute while
+// calls are waiting and a unit is free to take one.
+void advanceTime(int minutes) {
+    journalEvent(JOURNAL_ADVANCE, minutes, 0, 0, 0);
+    int endTime = sim->currentTime + minutes;
+    
+    while(sim->currentTime < endTime) {
+        int next = endTime;
+        
+        timerSkipStale();
+        if(sim->timerCount > 0 && sim->timerHeap[0].time < next)
+            next = sim->timerHeap[0].time;
+        
+        int nextDischarge = (sim->currentTime / 15 + 1) * 15;
+        if(nextDischarge < next) next = nextDischarge;
+        
+        if(sim->queueSize > 0 && sim->idleAmbulances > 0) next = sim->currentTime + 1;
+        
+        sim->currentTime = next > sim->currentTime ? next : sim->currentTime + 1;
+        simulateMinute();
+    }
+}
+
+
+//User Interface
+
+const char* getStateName(AmbulanceState state) {
+    switch(state) {
+        case IDLE: return "Available";
+        case TO_EMERGENCY: return "Going to scene";
+        case AT_SCENE: return "On scene";
+        case TO_HOSPITAL: return "To hospital";
+        case RETURNING: return "Returning to base";
+        default: return "Unknown";
+    }
+}
+
+void viewAmbulanceStatus() {
+    printf("\nAMBULANCE FLEET STATUS\n");
+    printf("\n\n");
+    
+    for(int i = 0; i < sim->ambulanceCount; i++) {
+        printf("  Unit-%d: %s", i + 1, getStateName(sim->unitState[i]));
+        
+        if(sim->unitState[i] == IDLE)
+            printf(" at %s", sim->locations[sim->unitLocation[i]].name);
+        else
+            printf(" (free in %d min)", sim->unitAvailableAt[i] - sim->currentTime);
+        
+        printf("\n");
+    }
+    printf("\n");
+}
+
+void makeEmergencyCall() {
+    char* operators[] = {"Sarah", "Mike", "Priya", "David", "Lisa"};
+    char* op = operators[rand() % 5];
+    
+    printf("\n\nEmergency 108 - Dispatch\n\n");
+    
+    char name[50];
     int loc, age;
     char choice;
     
-    printf("%s: Hi, I'm %s. Your name?\n", op, op);
-    printf("You: ");
-    scanf(" %[^\n]", name);
+    printf("%s: Hi, I'm %s. Your name?\n", op, op);
+    printf("You: ");
+    scanf(" %[^\n]", name);
+    
+    printf("\n%s: Where are you?\n\n", op);
+    for(int i = 0; i < sim->locationCount; i++)
+        printf("  %d - %s\n", i, sim->locations[i].name);
+    printf("\nYou: ");
+    scanf("%d", &loc);
+    
+    if(loc < 0 || loc >= sim->locationCount) {
+        printf("\nInvalid location!\n");
+        return;
+    }
+    
+    printf("\n%s: Emergency type?\n", op);
+    printf("  C-Heart  T-Accident  R-Breathing  I-Infection  G-Other\n");
+    printf("\nYou: ");
+    scanf(" %c", &choice);
+    
+    DiseaseType disease = GENERAL;
+    switch(choice) {
+        case 'C': case 'c': disease = CARDIAC; break;
+        case 'T': case 't': disease = TRAUMA; break;
+        case 'R': case 'r': disease = RESPIRATORY; break;
+        case 'I': case 'i': disease = INFECTION; break;
+    }
+    
+    printf("\n%s: Patient age?\n", op);
+    printf("You: ");
+    scanf("%d", &age);
+    
+    enqueueEmergency(name, loc, disease, age);
+    
+    printf("\n%s: Help is coming, %s!\n", op, name);
+    printf("  Call ID: #%03d\n", sim->nextEmergencyId - 1);
+    
+    advanceTime(2);
+}
+
+void viewSystemStatus() {
+    printf("\nSYSTEM STATUS OVERVIEW\n");
+    printf("\n\n");
+    
+    if(sim->activeCount == 0 && sim->queueSize == 0) {
+        printf("  No emergencies.\n");
+    } else {
+        if(sim->activeCount > 0) {
+            printf("  Active Emergencies:\n");
+            for(int i = 0; i < sim->activeCount; i++)
+                printf("    - %s at %s (Unit-%d)\n", 
+                       activeAt(i)->caller,
+                       sim->locations[activeAt(i)->location].name,
+                       activeAt(i)->assignedAmbulance + 1);
+        }
+        
+        if(sim->queueSize > 0) {
+            printf("\n  Waiting:\n");
+            for(int i = 0; i < sim->queueSize && i < 3; i++)
+                printf("    - %s (Priority %d)\n",
+                       pendingAt(i)->caller, effectivePriority(pendingAt(i)));
+            if(sim->queueSize > 3)
+                printf("    ... +%d more\n", sim->queueSize - 3);
+        }
+    }
+    
+    printf("\n  Stats: %d handled", sim->totalHandled);
+    if(sim->totalHandled > 0)
+        printf(", avg response %.1f min", (float)sim->totalResponseTime / sim->totalHandled);
+    printf("\n\n");
+}
+
+void viewHospitalStatus() {
+    printf("\nHOSPITAL STATUS\n");
+    printf("\n\n");
+    
+    for(int i = 0; i < sim->hospitalCount; i++) {
+        printf("  %s - %s\n", sim->hospitals[i].name, sim->locations[sim->hospitals[i].location].name);
+        printf("    Beds: %d/%d\n\n", sim->hospitals[i].patients, sim->hospitals[i].capacity);
+    }
+}
+
+void viewPendingEmergencies() {
+    printf("\nPENDING EMERGENCIES QUEUE\n");
+    printf("\n\n");
+    
+    if(sim->queueSize == 0) {
+        printf("  No pending emergencies.\n\n");
+    } else {
+        for(int i = 0; i < sim->queueSize; i++) {
+            Emergency* e = pendingAt(i);
+            printf("  #%d: %s\n", e->id, e->caller);
+            printf("      Location: %s\n", sim->locations[e->location].name);
+            printf("      Priority: %d (base %d)\n", effectivePriority(e), e->priority);
+            printf("      Waiting: %d min\n\n", sim->currentTime - e->reportTime);
+        }
+    }
+}
+
+void viewMapAndLocations() {
+    ensureRoadLists();
+    printf("\nMAP & LOCATIONS\n");
+    printf("\n\n");
+    
+    printf("  Locations:\n");
+    for(int i = 0; i < sim->locationCount; i++) {
+        printf("  %d. %s (x=%d, y=%d)\n", 
+               i, sim->locations[i].name, sim->locations[i].x, sim->locations[i].y);
+    }
+    
+    printf("\n  Road Connections:\n");
+    for(int i = 0; i < sim->locationCount; i++) {
+        printf("  %s: ", sim->locations[i].name);
+        Road* r = sim->roads[i];
+        int first = 1;
+        while(r != NULL) {
+            if(!first) printf(", ");
+            printf("%s (%dkm%s)", sim->locations[r->destination].name, r->distance, r->closed ? ", closed" : "");
+            first = 0;
+            r = r->next;
+        }
+        printf("\n");
+    }
+    printf("\n");
+}
+
+void viewStatistics() {
+    printf("\nSYSTEM STATISTICS\n");
+    printf("\n\n");
+    
+    printf("  Current Time: %d minutes\n", sim->currentTime);
+    printf("  Total Emergencies Handled: %d\n", sim->totalHandled);
+    printf("  Active Emergencies: %d\n", sim->activeCount);
+    printf("  Pending Emergencies: %d\n", sim->queueSize);
+    
+    if(sim->totalHandled > 0) {
+        printf("  Average Response Time: %.1f minutes\n", 
+               (float)sim->totalResponseTime / sim->totalHandled);
+    }
+    
+    printf("  Available Ambulances: %d/%d\n", countUnitsInState(IDLE), sim->ambulanceCount);
+    
+    int totalBeds = 0, usedBeds = 0;
+    for(int i = 0; i < sim->hospitalCount; i++) {
+        totalBeds += sim->hospitals[i].capacity;
+        usedBeds += sim->hospitals[i].patients;
+    }
+    printf("  Hospital Bed Usage: %d/%d\n", usedBeds, totalBeds);
+    
+    printf("  Reassignments: %ld (%ld minutes saved)\n",
+           sim->stats.reassignments, sim->stats.reassignMinutesSaved);
+    
+    printf("  Dispatch Mode: %s\n", sim->batchDispatch ? "Batch (optimal assignment)" : "Greedy");
+    if(sim->batchRounds > 0) {
+        printf("  Batch Travel Time: %ld min (greedy on the same calls: %ld min, saved %ld)\n",
+               sim->batchOptimalMinutes, sim->batchGreedyMinutes,
+               sim->batchGreedyMinutes - sim->batchOptimalMinutes);
+    }
+    printf("\n");
+}
+
+void printHistogram(FILE* out, const char* name, const Histogram* h) {
+    fprintf(out, "%s.count %ld\n", name, h->count);
+    if(h->count == 0) return;
+    fprintf(out, "%s.mean %.1f\n", name, (double)h->sum / h->count);
+    fprintf(out, "%s.min %ld\n", name, h->min);
+    fprintf(out, "%s.p50 %ld\n", name, histPercentile(h, 0.50));
+    fprintf(out, "%s.p90 %ld\n", name, histPercentile(h, 0.90));
+    fprintf(out, "%s.p99 %ld\n", name, histPercentile(h, 0.99));
+    fprintf(out, "%s.max %ld\n", name, h->max);
+}
+
+// Flat "name value" lines, one metric per line, for scripts and
+// dashboards. Names only ever get added, never renamed.
+void printStatsSnapshot(FILE* out) {
+    const char* diseases[] = { "", "general", "infection", "respiratory", "trauma", "cardiac" };
+    const SimStats* st = &sim->stats;
+    char name[64];
+    
+    fprintf(out, "time_minutes %d\n", sim->currentTime);
+    fprintf(out, "calls.pending %d\n", sim->queueSize);
+    fprintf(out, "calls.active %d\n", sim->activeCount);
+    fprintf(out, "calls.handled %d\n", sim->totalHandled);
+    fprintf(out, "units.idle %d\n", sim->idleAmbulances);
+    fprintf(out, "units.total %d\n", sim->ambulanceCount);
+    fprintf(out, "roads.closed %d\n", sim->closedRoads);
+    fprintf(out, "dispatch.count %ld\n", st->dispatches);
+    fprintf(out, "dispatch.requeued %ld\n", st->requeues);
+    fprintf(out, "reassign.count %ld\n", st->reassignments);
+    fprintf(out, "reassign.minutes_saved %ld\n", st->reassignMinutesSaved);
+    fprintf(out, "shortest_path.calls %ld\n", st->shortestPathCalls);
+    fprintf(out, "shortest_path.searches %ld\n", st->shortestPathSearches);
+    fprintf(out, "shortest_path.settled %ld\n", st->shortestPathSettled);
+    fprintf(out, "shortest_path.matrix_builds %ld\n", st->distanceMatrixBuilds);
+    fprintf(out, "shortest_path.row_repairs %ld\n", st->distanceRowRepairs);
+    fprintf(out, "nearest_unit.searches %ld\n", st->nearestUnitSearches);
+    printHistogram(out, "shortest_path.search_ns", &st->searchNanos);
+    printHistogram(out, "dispatch.decision_ns", &st->dispatchNanos);
+    printHistogram(out, "queue.wait_minutes", &st->queueWaitMinutes);
+    for(int d = GENERAL; d <= CARDIAC; d++) {
+        snprintf(name, sizeof(name), "response_minutes.%s", diseases[d]);
+        printHistogram(out, name, &st->responseByDisease[d]);
+    }
+}
+
+void toggleRoadClosure() {
+    int from, to;
+    printf("\n  Road between which locations? (0-%d, e.g. 1 2): ", sim->locationCount - 1);
+    if(scanf("%d %d", &from, &to) != 2 || from < 0 || from >= sim->locationCount ||
+       to < 0 || to >= sim->locationCount) {
+        printf("\n  Invalid location!\n");
+        return;
+    }
+    
+    if(closeRoad(from, to))
+        printf("\n  Road %s - %s closed\n", sim->locations[from].name, sim->locations[to].name);
+    else if(reopenRoad(from, to))
+        printf("\n  Road %s - %s reopened\n", sim->locations[from].name, sim->locations[to].name);
+    else
+        printf("\n  No road between %s and %s\n", sim->locations[from].name, sim->locations[to].name);
+}
+
+void autoRunSimulation() {
+    printf("\n  Running simulation for 10 time steps...\n\n");
+    for(int i = 0; i < 10; i++) {
+        logFlush();
+        printf("  Step %d (Time: %d min)\n", i + 1, sim->currentTime + 1);
+        advanceTime(1);
+    }
+    logFlush();
+    printf("\n  Simulation complete!\n\n");
+}
+
+void showMenu() {
+    printf("\nAMBULANCE DISPATCH MANAGEMENT SYSTEM\n\n");
+    printf("  1. Report New Emergency\n");
+    printf("  2. View System Status\n");
+    printf("  3. View Ambulance Status\n");
+    printf("  4. View Hospital Status\n");
+    printf("  5. View Pending Emergencies\n");
+    printf("  6. Advance Time (Step Simulation)\n");
+    printf("  7. Auto-Run Simulation (10 steps)\n");
+    printf("  8. View Map & Locations\n");
+    printf("  9. System Statistics\n");
+    printf(" 10. Toggle Batch Dispatch (%s)\n", sim->batchDispatch ? "on" : "off");
+    printf(" 11. Stats Snapshot\n");
+    printf(" 12. Close / Reopen Road\n");
+    printf(" 13. Save Checkpoint\n");
+    printf("  0. Exit\n");
+    printf("------------------------------------\n");
+    printf("Current Time: %d minutes | Pending: %d | Active: %d\n\n", 
+           sim->currentTime, sim->queueSize, sim->activeCount);
+    printf("  Choice: ");
+}
+
+
+//Snapshots
+
+// Checkpoint of a whole run: a header with every scalar, then one flat
+// array per store, each starting on a 64-byte boundary so it can be used
+// straight from the mapped file. Records are the in-memory structs, so a
+// snapshot only loads into the build that wrote it (elemSize guards
+// that). Written to a temporary name and renamed, like the CH file.
+enum {
+    SNAP_LOCATIONS,
+    SNAP_CSR_OFFSET,
+    SNAP_CSR_TARGET,
+    SNAP_CSR_WEIGHT,
+    SNAP_CSR_PROFILE,
+    SNAP_ROAD_DISTANCE,
+    SNAP_ROAD_CLOSED,
+    SNAP_HOSPITALS,
+    SNAP_AMBULANCES,
+    SNAP_UNIT_STATE,
+    SNAP_UNIT_LOCATION,
+    SNAP_UNIT_AVAILABLE,
+    SNAP_ACTIVE,
+    SNAP_PENDING,
+    SNAP_PENDING_KEYS,
+    SNAP_TIMERS,
+    SNAP_SECTIONS
+};
+
+typedef struct {
+    long long offset;
+    long long count;
+    int elemSize;
+    int reserved;
+} SnapshotSection;
+
+typedef struct {
+    int currentTime;
+    int nextEmergencyId;
+    int totalHandled;
+    int totalResponseTime;
+    int roadCount;
+    int closedRoads;
+    int trafficEnabled;
+    int batchDispatch;
+    int batchRounds;
+    int fedCalls;
+    int fedClosures;
+    long batchOptimalMinutes;
+    long batchGreedyMinutes;
+    unsigned long long rngState;
+    double minutesPerUnit;
+    int responseMinutes[RESPONSE_HIST_SIZE];
+    TrafficProfile trafficProfiles[TRAFFIC_MAX_PROFILES];
+    short trafficPercent[TRAFFIC_MAX_PROFILES][TRAFFIC_BUCKETS];
+    SimStats stats;
+} SnapshotState;
+
+typedef struct {
+    char magic[8];
+    int version;
+    int headerSize;
+    SnapshotSection sections[SNAP_SECTIONS];
+    SnapshotState state;
+} SnapshotHeader;
+
+void resetSystem();
+
+int writeSnapshotSection(FILE* f, SnapshotSection* s, const void* data, long long count, int elemSize) {
+    static const char padding[64];
+    long pos = ftell(f);
+    long start = (pos + 63) & ~63L;
+    if(pos < 0 || fwrite(padding, 1, start - pos, f) != (size_t)(start - pos)) return 0;
+    
+    s->offset = start;
+    s->count = count;
+    s->elemSize = elemSize;
+    return count == 0 || fwrite(data, elemSize, count, f) == (size_t)count;
+}
+
+// An open journal starts over from the snapshot, so the latest snapshot
+// and the journal together always hold the whole run
+int saveSnapshot(const char* path) {
+    if(!sim->csrValid) buildRoadGraph();
+    
+    char tmpPath[4096];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp%ld", path, (long)getpid());
+    FILE* f = fopen(tmpPath, "wb");
+    if(!f) return 0;
+    
+    SnapshotHeader* header = calloc(1, sizeof(SnapshotHeader));
+    int n = sim->locationCount, roads = sim->roadCount;
+    int* distance = malloc((roads + 1) * sizeof(int));
+    unsigned char* closed = malloc(roads + 1);
+    Emergency* active = malloc((sim->activeCount + 1) * sizeof(Emergency));
+    Emergency* pending = malloc((sim->queueSize + 1) * sizeof(Emergency));
+    int* pendingKeys = malloc((sim->queueSize + 1) * sizeof(int));
+    if(!header || !distance || !closed || !active || !pending || !pendingKeys) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    
+    // Road lists in CSR order; a snapshot that was never unpacked
+    // still has them as arrays
+    if(sim->roadListsPending) {
+        memcpy(distance, sim->mappedRoadDistance, roads * sizeof(int));
+        memcpy(closed, sim->mappedRoadClosed, roads);
+    }
+    else {
+        int e = 0;
+        for(int v = 0; v < n; v++)
+            for(Road* r = sim->roads[v]; r != NULL; r = r->next, e++) {
+                distance[e] = r->distance;
+                closed[e] = (unsigned char)r->closed;
+            }
+    }
+    for(int i = 0; i < sim->activeCount; i++) active[i] = *activeAt(i);
+    // Heap order as is, so the restored queue pops in the same order
+    for(int i = 0; i < sim->queueSize; i++) {
+        pending[i] = *pendingAt(i);
+        pendingKeys[i] = sim->pendingHeap[i].key;
+    }
+    
+    memcpy(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic));
+    header->version = SNAPSHOT_VERSION;
+    header->headerSize = sizeof(SnapshotHeader);
+    SnapshotState* st = &header->state;
+    st->currentTime = sim->currentTime;
+    st->nextEmergencyId = sim->nextEmergencyId;
+    st->totalHandled = sim->totalHandled;
+    st->totalResponseTime = sim->totalResponseTime;
+    st->roadCount = roads;
+    st->closedRoads = sim->closedRoads;
+    st->trafficEnabled = sim->trafficEnabled;
+    st->batchDispatch = sim->batchDispatch;
+    st->batchRounds = sim->batchRounds;
+    st->fedCalls = sim->fedCalls;
+    st->fedClosures = sim->fedClosures;
+    st->batchOptimalMinutes = sim->batchOptimalMinutes;
+    st->batchGreedyMinutes = sim->batchGreedyMinutes;
+    st->rngState = sim->rngState;
+    st->minutesPerUnit = sim->minutesPerUnit;
+    memcpy(st->responseMinutes, sim->responseMinutes, sizeof(st->responseMinutes));
+    memcpy(st->trafficProfiles, sim->trafficProfiles, sizeof(st->trafficProfiles));
+    memcpy(st->trafficPercent, sim->trafficPercent, sizeof(st->trafficPercent));
+    st->stats = sim->stats;
+    
+    SnapshotSection* sec = header->sections;
+    int u = sim->ambulanceCount;
+    int ok = fwrite(header, sizeof(SnapshotHeader), 1, f) == 1 &&
+        writeSnapshotSection(f, &sec[SNAP_LOCATIONS], sim->locations, n, sizeof(Location)) &&
+        writeSnapshotSection(f, &sec[SNAP_CSR_OFFSET], sim->csrOffset, n + 1, sizeof(int)) &&
+        writeSnapshotSection(f, &sec[SNAP_CSR_TARGET], sim->csrTarget, roads, sizeof(int)) &&
+        writeSnapshotSection(f, &sec[SNAP_CSR_WEIGHT], sim->csrWeight, roads, sizeof(int)) &&
+        writeSnapshotSection(f, &sec[SNAP_CSR_PROFILE], sim->csrProfile, roads, sizeof(int)) &&
+        writeSnapshotSection(f, &sec[SNAP_ROAD_DISTANCE], distance, roads, sizeof(int)) &&
+        writeSnapshotSection(f, &sec[SNAP_ROAD_CLOSED], closed, roads, 1) &&
+        writeSnapshotSection(f, &sec[SNAP_HOSPITALS], sim->hospitals, sim->hospitalCount, sizeof(Hospital)) &&
+        writeSnapshotSection(f, &sec[SNAP_AMBULANCES], sim->ambulances, u, sizeof(Ambulance)) &&
+        writeSnapshotSection(f, &sec[SNAP_UNIT_STATE], sim->unitState, u, 1) &&
+        writeSnapshotSection(f, &sec[SNAP_UNIT_LOCATION], sim->unitLocation, u, sizeof(int)) &&
+        writeSnapshotSection(f, &sec[SNAP_UNIT_AVAILABLE], sim->unitAvailableAt, u, sizeof(int)) &&
+        writeSnapshotSection(f, &sec[SNAP_ACTIVE], active, sim->activeCount, sizeof(Emergency)) &&
+        writeSnapshotSection(f, &sec[SNAP_PENDING], pending, sim->queueSize, sizeof(Emergency)) &&
+        writeSnapshotSection(f, &sec[SNAP_PENDING_KEYS], pendingKeys, sim->queueSize, sizeof(int)) &&
+        writeSnapshotSection(f, &sec[SNAP_TIMERS], sim->timerHeap, sim->timerCount, sizeof(TimerEvent));
+    // Section table last, now that every offset is known
+    ok = ok && fseek(f, 0, SEEK_SET) == 0 && fwrite(header, sizeof(SnapshotHeader), 1, f) == 1;
+    if(fclose(f) != 0) ok = 0;
+    
+    free(header); free(distance); free(closed); free(active); free(pending); free(pendingKeys);
+    if(!ok || rename(tmpPath, path) != 0) {
+        remove(tmpPath);
+        return 0;
+    }
+    journalRestart();
+    return 1;
+}
+
+// Start of section s in the mapped file
+const void* snapshotData(const char* base, const SnapshotHeader* header, int s) {
+    return base + header->sections[s].offset;
+}
+
+// Checks the header, the section table, every index a store holds and
+// every value used to index a table (disease, specialty, traffic
+// profile) against the file, before any of it is trusted
+int validateSnapshot(const char* base, size_t size) {
+    if(size < sizeof(SnapshotHeader)) return 0;
+    const SnapshotHeader* header = (const SnapshotHeader*)base;
+    if(memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+       header->version != SNAPSHOT_VERSION || header->headerSize != (int)sizeof(SnapshotHeader))
+        return 0;
+    
+    const int elemSize[SNAP_SECTIONS] = {
+        sizeof(Location), sizeof(int), sizeof(int), sizeof(int), sizeof(int), sizeof(int), 1,
+        sizeof(Hospital), sizeof(Ambulance), 1, sizeof(int), sizeof(int),
+        sizeof(Emergency), sizeof(Emergency), sizeof(int), sizeof(TimerEvent)
+    };
+    const SnapshotSection* sec = header->sections;
+    for(int s = 0; s < SNAP_SECTIONS; s++) {
+        if(sec[s].elemSize != elemSize[s] || sec[s].count < 0 || sec[s].count > INT_MAX ||
+           sec[s].offset < (long long)sizeof(SnapshotHeader) || sec[s].offset % 64 != 0 ||
+           sec[s].offset > (long long)size || sec[s].count > ((long long)size - sec[s].offset) / elemSize[s])
+            return 0;
+    }
+    
+    long long n = sec[SNAP_LOCATIONS].count, roads = header->state.roadCount;
+    long long hospitals = sec[SNAP_HOSPITALS].count, units = sec[SNAP_AMBULANCES].count;
+    if(sec[SNAP_CSR_OFFSET].count != n + 1 || sec[SNAP_CSR_TARGET].count != roads ||
+       sec[SNAP_CSR_WEIGHT].count != roads || sec[SNAP_CSR_PROFILE].count != roads ||
+       sec[SNAP_ROAD_DISTANCE].count != roads || sec[SNAP_ROAD_CLOSED].count != roads ||
+       sec[SNAP_UNIT_STATE].count != units || sec[SNAP_UNIT_LOCATION].count != units ||
+       sec[SNAP_UNIT_AVAILABLE].count != units || sec[SNAP_PENDING_KEYS].count != sec[SNAP_PENDING].count)
+        return 0;
+    
+    // Travel times are scaled by these percents, so a profile a road
+    // follows must never make a road free or negative
+    int profileUsable[TRAFFIC_MAX_PROFILES];
+    for(int p = 0; p < TRAFFIC_MAX_PROFILES; p++) {
+        profileUsable[p] = 1;
+        for(int b = 0; b < TRAFFIC_BUCKETS; b++)
+            if(header->state.trafficPercent[p][b] <= 0) profileUsable[p] = 0;
+    }
+    
+    const int* offset = snapshotData(base, header, SNAP_CSR_OFFSET);
+    const int* target = snapshotData(base, header, SNAP_CSR_TARGET);
+    const int* weight = snapshotData(base, header, SNAP_CSR_WEIGHT);
+    const int* profile = snapshotData(base, header, SNAP_CSR_PROFILE);
+    if(offset[0] != 0 || offset[n] != roads) return 0;
+    for(long long v = 0; v < n; v++)
+        if(offset[v + 1] < offset[v]) return 0;
+    for(long long e = 0; e < roads; e++)
+        if(target[e] < 0 || target[e] >= n || weight[e] < 0 ||
+           profile[e] < 0 || profile[e] >= TRAFFIC_MAX_PROFILES || (profile[e] != 0 && !profileUsable[profile[e]]))
+            return 0;
+    
+    const Hospital* hosp = snapshotData(base, header, SNAP_HOSPITALS);
+    for(long long h = 0; h < hospitals; h++)
+        if(hosp[h].location < 0 || hosp[h].location >= n ||
+           hosp[h].specialty < GENERAL || hosp[h].specialty > CARDIAC)
+            return 0;
+    
+    // Ids key the active and pending indexes, where -1 marks an empty
+    // slot, and are unique across both sections
+    IdMap ids = {0};
+    int ok = 1;
+    for(int s = SNAP_ACTIVE; s <= SNAP_PENDING && ok; s++) {
+        const Emergency* e = snapshotData(base, header, s);
+        for(long long i = 0; i < sec[s].count && ok; i++) {
+            if(e[i].id < 0 || e[i].id >= header->state.nextEmergencyId || idMapGet(&ids, e[i].id) != -1 ||
+               e[i].location < 0 || e[i].location >= n ||
+               e[i].disease < GENERAL || e[i].disease > CARDIAC ||
+               e[i].assignedAmbulance < -1 || e[i].assignedAmbulance >= units)
+                ok = 0;
+            else idMapPut(&ids, e[i].id, s == SNAP_ACTIVE ? (int)i : INT_MAX);
+        }
+    }
+    
+    // The pending heap is restored as stored, so its order must hold
+    const Emergency* pend = snapshotData(base, header, SNAP_PENDING);
+    const int* keys = snapshotData(base, header, SNAP_PENDING_KEYS);
+    for(long long i = 1; i < sec[SNAP_PENDING].count && ok; i++) {
+        QueueKey child = { keys[i], pend[i].id, 0 }, parent = { keys[(i-1)/2], pend[(i-1)/2].id, 0 };
+        if(queueBefore(child, parent)) ok = 0;
+    }
+    
+    // A unit's call is active and assigned to it
+    const Ambulance* amb = snapshotData(base, header, SNAP_AMBULANCES);
+    const Emergency* act = snapshotData(base, header, SNAP_ACTIVE);
+    const unsigned char* state = snapshotData(base, header, SNAP_UNIT_STATE);
+    const int* location = snapshotData(base, header, SNAP_UNIT_LOCATION);
+    for(long long i = 0; i < units && ok; i++) {
+        int call = amb[i].targetEmergency < 0 ? -1 : idMapGet(&ids, amb[i].targetEmergency);
+        if(state[i] > RETURNING || location[i] < 0 || location[i] >= n ||
+           amb[i].baseHospital < 0 || amb[i].baseHospital >= hospitals ||
+           amb[i].targetHospital < -1 || amb[i].targetHospital >= hospitals ||
+           amb[i].legStart < -1 || amb[i].legStart > header->state.currentTime ||
+           (amb[i].targetEmergency != -1 &&
+            (call == -1 || call == INT_MAX || act[call].assignedAmbulance != i)))
+            ok = 0;
+    }
+    free(ids.keys);
+    free(ids.values);
+    if(!ok) return 0;
+    
+    const TimerEvent* timers = snapshotData(base, header, SNAP_TIMERS);
+    for(long long i = 0; i < sec[SNAP_TIMERS].count; i++)
+        if(timers[i].ambulance < 0 || timers[i].ambulance >= units) return 0;
+    return 1;
+}
+
+// Replaces the whole run with the snapshot at `path`. The road graph is
+// used in place from the mapping; everything else is small and copied.
+// Returns 0, leaving the run untouched, if the file is missing, damaged
+// or from another build.
+int loadSnapshot(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) return 0;
+    struct stat info;
+    if(fstat(fd, &info) != 0 || info.st_size <= 0) {
+        close(fd);
+        return 0;
+    }
+    size_t size = info.st_size;
+    char* base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED) return 0;
+    if(!validateSnapshot(base, size)) {
+        munmap(base, size);
+        return 0;
+    }
+    
+    const SnapshotHeader* header = (const SnapshotHeader*)base;
+    const SnapshotSection* sec = header->sections;
+    const SnapshotState* st = &header->state;
+    int n = sec[SNAP_LOCATIONS].count, u = sec[SNAP_AMBULANCES].count;
+    int active = sec[SNAP_ACTIVE].count, pending = sec[SNAP_PENDING].count;
+    
+    resetSystem();
+    reserveCapacity(n, sec[SNAP_HOSPITALS].count, u, active > pending ? active : pending);
+    
+    memcpy(sim->locations, snapshotData(base, header, SNAP_LOCATIONS), n * sizeof(Location));
+    for(int v = 0; v < n; v++) {
+        sim->roads[v] = NULL;
+        sim->scratchDist[v] = 99999;
+        sim->scratchOwner[v] = -1;
+    }
+    sim->locationCount = n;
+    
+    memcpy(sim->csrOffset, snapshotData(base, header, SNAP_CSR_OFFSET), (n + 1) * sizeof(int));
+    free(sim->csrTarget);
+    free(sim->csrWeight);
+    free(sim->csrProfile);
+    sim->csrTarget = (int*)snapshotData(base, header, SNAP_CSR_TARGET);
+    sim->csrWeight = (int*)snapshotData(base, header, SNAP_CSR_WEIGHT);
+    sim->csrProfile = (int*)snapshotData(base, header, SNAP_CSR_PROFILE);
+    sim->mappedRoadDistance = snapshotData(base, header, SNAP_ROAD_DISTANCE);
+    sim->mappedRoadClosed = snapshotData(base, header, SNAP_ROAD_CLOSED);
+    sim->graphMap = base;
+    sim->graphMapSize = size;
+    sim->mappedNodes = n;
+    sim->roadListsPending = 1;
+    sim->roadCount = st->roadCount;
+    sim->closedRoads = st->closedRoads;
+    sim->minutesPerUnit = st->minutesPerUnit;
+    sim->csrValid = 1;
+    sim->landmarksValid = 0;
+    sim->chValid = 0;
+    memcpy(sim->trafficProfiles, st->trafficProfiles, sizeof(st->trafficProfiles));
+    memcpy(sim->trafficPercent, st->trafficPercent, sizeof(st->trafficPercent));
+    sim->trafficEnabled = st->trafficEnabled;
+    
+    sim->hospitalCount = sec[SNAP_HOSPITALS].count;
+    memcpy(sim->hospitals, snapshotData(base, header, SNAP_HOSPITALS), sim->hospitalCount * sizeof(Hospital));
+    sim->ambulanceCount = u;
+    memcpy(sim->ambulances, snapshotData(base, header, SNAP_AMBULANCES), u * sizeof(Ambulance));
+    memcpy(sim->unitState, snapshotData(base, header, SNAP_UNIT_STATE), u);
+    memcpy(sim->unitLocation, snapshotData(base, header, SNAP_UNIT_LOCATION), u * sizeof(int));
+    memcpy(sim->unitAvailableAt, snapshotData(base, header, SNAP_UNIT_AVAILABLE), u * sizeof(int));
+    
+    const Emergency* activeRecords = snapshotData(base, header, SNAP_ACTIVE);
+    for(int i = 0; i < active; i++) addActiveEmergency(&activeRecords[i]);
+    
+    const Emergency* pendingRecords = snapshotData(base, header, SNAP_PENDING);
+    const int* pendingKeys = snapshotData(base, header, SNAP_PENDING_KEYS);
+    for(int i = 0; i < pending; i++) {
+        sim->pendingRecords[i] = pendingRecords[i];
+        QueueKey key = { pendingKeys[i], pendingRecords[i].id, i };
+        sim->pendingHeap[i] = key;
+        sim->pendingPos[i] = i;
+        idMapPut(&sim->pendingIndex, pendingRecords[i].id, i);
+    }
+    sim->pendingSlotCount = pending;
+    sim->queueSize = pending;
+    
+    sim->timerCount = sec[SNAP_TIMERS].count;
+    sim->timerHeap = reserveArray(sim->timerHeap, &sim->timerCap, sim->timerCount, sizeof(TimerEvent));
+    memcpy(sim->timerHeap, snapshotData(base, header, SNAP_TIMERS), sim->timerCount * sizeof(TimerEvent));
+    
+    sim->currentTime = st->currentTime;
+    sim->idleAmbulances = 0;
+    for(int i = 0; i < u; i++)
+        if(sim->unitState[i] == IDLE) sim->idleAmbulances++;
+    sim->nextEmergencyId = st->nextEmergencyId;
+    sim->totalHandled = st->totalHandled;
+    sim->totalResponseTime = st->totalResponseTime;
+    sim->batchDispatch = st->batchDispatch;
+    sim->batchRounds = st->batchRounds;
+    sim->batchOptimalMinutes = st->batchOptimalMinutes;
+    sim->batchGreedyMinutes = st->batchGreedyMinutes;
+    sim->fedCalls = st->fedCalls;
+    sim->fedClosures = st->fedClosures;
+    sim->rngState = st->rngState;
+    memcpy(sim->responseMinutes, st->responseMinutes, sizeof(st->responseMinutes));
+    sim->stats = st->stats;
+    
+    // Nothing mapped worth keeping
+    if(sim->roadCount == 0) {
+        sim->roadListsPending = 0;
+        releaseMappedGraph();
+    }
+    return 1;
+}
+
+
+void saveCheckpoint() {
+    char path[256];
+    printf("\n  Snapshot file: ");
+    if(scanf("%255s", path) != 1) return;
+    if(saveSnapshot(path))
+        printf("\n  Saved checkpoint at minute %d to %s\n", sim->currentTime, path);
+    else
+        printf("\n  Could not write %s\n", path);
+}
+
+
+//Journal Replay
+
+// Maps the journal at `path` for replay and checks it starts from the
+// current state; the run then takes its RNG stream and dispatch mode
+// from the journal. Returns 0 with a message if it cannot be used.
+int journalReplayOpen(const char* path) {
+    Journal* j = &sim->journal;
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        fprintf(stderr, "Cannot open journal %s\n", path);
+        return 0;
+    }
+    struct stat info;
+    void* base = MAP_FAILED;
+    if(fstat(fd, &info) == 0 && info.st_size >= (off_t)sizeof(JournalHeader))
+        base = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED) {
+        fprintf(stderr, "%s: not a journal\n", path);
+        return 0;
+    }
+    
+    const JournalHeader* header = base;
+    if(memcmp(header->magic, JOURNAL_MAGIC, sizeof(header->magic)) != 0 ||
+       header->version != JOURNAL_VERSION || header->recordSize != (int)sizeof(JournalRecord)) {
+        fprintf(stderr, "%s: not a journal from this build\n", path);
+        munmap(base, info.st_size);
+        return 0;
+    }
+    if(header->startTime != sim->currentTime || header->nextEmergencyId != sim->nextEmergencyId) {
+        fprintf(stderr, "%s: journal starts at minute %d (call #%d), state is at minute %d (call #%d)\n",
+                path, header->startTime, header->nextEmergencyId, sim->currentTime, sim->nextEmergencyId);
+        munmap(base, info.st_size);
+        return 0;
+    }
+    
+    sim->rngState = header->rngState;
+    sim->batchDispatch = header->batchDispatch;
+    j->replay = base;
+    j->replaySize = info.st_size;
+    j->replayPos = sizeof(JournalHeader);
+    j->replayChecked = 0;
+    j->replayDiverged = 0;
+    return 1;
+}
+
+void journalReplayClose() {
+    Journal* j = &sim->journal;
+    if(!j->replay) return;
+    munmap((void*)j->replay, j->replaySize);
+    j->replay = NULL;
+}
+
+// Next unchecked record, or 0 at the end (or a cut-off last record)
+int journalPeek(JournalRecord* r, char* caller) {
+    Journal* j = &sim->journal;
+    if(j->replayPos + sizeof(JournalRecord) > j->replaySize) return 0;
+    memcpy(r, j->replay + j->replayPos, sizeof(JournalRecord));
+    if(j->replayPos + journalRecordSize(r->type) > j->replaySize) return 0;
+    if(r->type == JOURNAL_CALL) {
+        memcpy(caller, j->replay + j->replayPos + sizeof(JournalRecord), JOURNAL_CALLER_SIZE);
+        caller[JOURNAL_CALLER_SIZE - 1] = '\0';
+    }
+    return 1;
+}
+
+int validLocation(int loc) {
+    return loc >= 0 && loc < sim->locationCount;
+}
+
+// Re-runs the journaled inputs. Each one is fed back through the same
+// function that journaled it, so its record and every transition it
+// causes are checked against the journal as they happen. Returns 0 if
+// the run went differently.
+int replayJournal() {
+    Journal* j = &sim->journal;
+    JournalRecord r;
+    char caller[JOURNAL_CALLER_SIZE];
+    
+    while(!j->replayDiverged && journalPeek(&r, caller)) {
+        int ok = r.time == sim->currentTime;
+        if(ok) switch(r.type) {
+            case JOURNAL_ADVANCE:
+                if((ok = r.arg[0] >= 0)) advanceTime(r.arg[0]);
+                break;
+            case JOURNAL_CALL:
+                if((ok = validLocation(r.arg[1]) && r.arg[2] >= GENERAL && r.arg[2] <= CARDIAC))
+                    enqueueEmergency(caller, r.arg[1], (DiseaseType)r.arg[2], r.arg[3]);
+                break;
+            case JOURNAL_CLOSE:
+            case JOURNAL_REOPEN:
+                if(!validLocation(r.arg[0]) || !validLocation(r.arg[1])) ok = 0;
+                else if(r.type == JOURNAL_CLOSE) ok = closeRoad(r.arg[0], r.arg[1]);
+                else ok = reopenRoad(r.arg[0], r.arg[1]);
+                break;
+            case JOURNAL_BATCH:
+                setBatchDispatch(r.arg[0] != 0);
+                break;
+            default:
+                // A transition no input accounts for
+                ok = 0;
+        }
+        if(!ok && !j->replayDiverged) {
+            fprintf(stderr, "Replay diverged after %ld records: cannot apply type %d at minute %d\n",
+                    j->replayChecked, r.type, r.time);
+            j->replayDiverged = 1;
+        }
+    }
+    return !j->replayDiverged;
+}
+
+
+//Headless Scenario Runs
+
+// Scenario file, one directive per line ('#' starts a comment):
+//   location <x> <y> <name>
+//   road <from> <to> <minutes> [profile]
+//   traffic <profile> <minute>:<percent> ...
+//   hospital <location> <capacity> <specialty> <name>
+//   ambulance <location> <baseHospital>
+//   call <time> <location> <disease> <age> <caller>
+//   close <time> <from> <to>
+//   reopen <time> <from> <to>
+//   dispatch greedy|batch
+// Locations and hospitals are numbered from 0 in file order. Diseases
+// are GENERAL, INFECTION, RESPIRATORY, TRAUMA, CARDIAC or 1-5. Traffic
+// profiles are numbered 1 to TRAFFIC_MAX_PROFILES - 1; each point gives
+// the travel time, in percent of free flow, at a minute of the day.
+typedef struct {
+    int from, to, distance, profile;
+} ScenarioRoad;
+
+typedef struct {
+    char name[50];
+    int location, capacity;
+    DiseaseType specialty;
+} ScenarioHospital;
+
+typedef struct {
+    int location, baseHospital;
+} ScenarioAmbulance;
+
+typedef struct {
+    int time, order;
+    char caller[50];
+    int location, age;
+    DiseaseType disease;
+} ScenarioCall;
+
+typedef struct {
+    int time, order;
+    int from, to, closed;
+} ScenarioClosure;
+
+typedef struct {
+    Location* locations; int locationCount, locationCap;
+    ScenarioRoad* roads; int roadCount, roadCap;
+    ScenarioHospital* hospitals; int hospitalCount, hospitalCap;
+    ScenarioAmbulance* ambulances; int ambulanceCount, ambulanceCap;
+    ScenarioCall* calls; int callCount, callCap;
+    ScenarioClosure* closures; int closureCount, closureCap;
+    TrafficProfile traffic[TRAFFIC_MAX_PROFILES];
+    int batch;
+} Scenario;
+
+DiseaseType parseDisease(const char* word) {
+    const char* names[] = { "GENERAL", "INFECTION", "RESPIRATORY", "TRAUMA", "CARDIAC" };
+    for(int i = 0; i < 5; i++)
+        if(strcmp(word, names[i]) == 0) return (DiseaseType)(i + 1);
+    int n = atoi(word);
+    return (n >= GENERAL && n <= CARDIAC) ? (DiseaseType)n : 0;
+}
+
+int compareCalls(const void* a, const void* b) {
+    const ScenarioCall* x = a;
+    const ScenarioCall* y = b;
+    if(x->time != y->time) return x->time - y->time;
+    return x->order - y->order;
+}
+
+int compareClosures(const void* a, const void* b) {
+    const ScenarioClosure* x = a;
+    const ScenarioClosure* y = b;
+    if(x->time != y->time) return x->time - y->time;
+    return x->order - y->order;
+}
+
+void freeScenario(Scenario* sc) {
+    free(sc->locations);
+    free(sc->roads);
+    free(sc->hospitals);
+    free(sc->ambulances);
+    free(sc->calls);
+    free(sc->closures);
+    memset(sc, 0, sizeof(*sc));
+}
+
+// Returns 0 and prints the offending line on a malformed file
+int loadScenario(const char* path, Scenario* sc) {
+    memset(sc, 0, sizeof(*sc));
     
-    printf("\n%s: Where are you?\n\n", op);
-    for(int i = 0; i < MAX_LOCATIONS; i++)
-        printf("  %d - %s\n", i, locations[i].name);
-    printf("\nYou: ");
-    scanf("%d", &loc);
+    FILE* f = fopen(path, "r");
+    if(!f) {
+        fprintf(stderr, "Cannot open scenario %s\n", path);
+        return 0;
+    }
     
-    if(loc < 0 || loc >= MAX_LOCATIONS) {
-        printf("\nInvalid location!\n");
-        return;
+    char line[256], word[32];
+    int lineNo = 0, ok = 1;
+    
+    while(ok && fgets(line, sizeof(line), f)) {
+        lineNo++;
+        char* hash = strchr(line, '#');
+        if(hash) *hash = '\0';
+        if(sscanf(line, "%31s", word) != 1) continue;
+        
+        if(strcmp(word, "location") == 0) {
+            sc->locations = reserveArray(sc->locations, &sc->locationCap, sc->locationCount + 1, sizeof(Location));
+            Location* l = &sc->locations[sc->locationCount];
+            ok = sscanf(line, "%*s %d %d %49[^\r\n]", &l->x, &l->y, l->name) == 3;
+            sc->locationCount += ok;
+        }
+        else if(strcmp(word, "road") == 0) {
+            sc->roads = reserveArray(sc->roads, &sc->roadCap, sc->roadCount + 1, sizeof(ScenarioRoad));
+            ScenarioRoad* r = &sc->roads[sc->roadCount];
+            r->profile = 0;
+            ok = sscanf(line, "%*s %d %d %d %d", &r->from, &r->to, &r->distance, &r->profile) >= 3 && r->distance >= 0;
+            sc->roadCount += ok;
+        }
+        else if(strcmp(word, "hospital") == 0) {
+            sc->hospitals = reserveArray(sc->hospitals, &sc->hospitalCap, sc->hospitalCount + 1, sizeof(ScenarioHospital));
+            ScenarioHospital* h = &sc->hospitals[sc->hospitalCount];
+            char spec[32];
+            ok = sscanf(line, "%*s %d %d %31s %49[^\r\n]", &h->location, &h->capacity, spec, h->name) == 4 &&
+                 (h->specialty = parseDisease(spec)) != 0;
+            sc->hospitalCount += ok;
+        }
+        else if(strcmp(word, "ambulance") == 0) {
+            sc->ambulances = reserveArray(sc->ambulances, &sc->ambulanceCap, sc->ambulanceCount + 1, sizeof(ScenarioAmbulance));
+            ScenarioAmbulance* a = &sc->ambulances[sc->ambulanceCount];
+            ok = sscanf(line, "%*s %d %d", &a->location, &a->baseHospital) == 2;
+            sc->ambulanceCount += ok;
+        }
+        else if(strcmp(word, "call") == 0) {
+            sc->calls = reserveArray(sc->calls, &sc->callCap, sc->callCount + 1, sizeof(ScenarioCall));
+            ScenarioCall* c = &sc->calls[sc->callCount];
+            char disease[32];
+            ok = sscanf(line, "%*s %d %d %31s %d %49[^\r\n]", &c->time, &c->location, disease, &c->age, c->caller) == 5 &&
+                 c->time >= 0 && (c->disease = parseDisease(disease)) != 0;
+            c->order = sc->callCount;
+            sc->callCount += ok;
+        }
+        else if(strcmp(word, "close") == 0 || strcmp(word, "reopen") == 0) {
+            sc->closures = reserveArray(sc->closures, &sc->closureCap, sc->closureCount + 1, sizeof(ScenarioClosure));
+            ScenarioClosure* c = &sc->closures[sc->closureCount];
+            ok = sscanf(line, "%*s %d %d %d", &c->time, &c->from, &c->to) == 3 && c->time >= 0;
+            c->closed = strcmp(word, "close") == 0;
+            c->order = sc->closureCount;
+            sc->closureCount += ok;
+        }
+        else if(strcmp(word, "traffic") == 0) {
+            int profile, used;
+            ok = sscanf(line, "%*s %d%n", &profile, &used) == 1 && profile >= 1 && profile < TRAFFIC_MAX_PROFILES;
+            TrafficProfile* p = ok ? &sc->traffic[profile] : NULL;
+            
+            int minute, percent, n;
+            const char* rest = line + (ok ? used : 0);
+            if(ok) p->points = 0;
+            while(ok && sscanf(rest, " %d:%d%n", &minute, &percent, &n) == 2) {
+                ok = p->points < TRAFFIC_MAX_POINTS && minute >= 0 && minute < 24 * 60 && percent >= 0 &&
+                     (p->points == 0 || minute > p->minute[p->points - 1]);
+                if(ok) {
+                    p->minute[p->points] = minute;
+                    p->percent[p->points++] = percent;
+                }
+                rest += n;
+            }
+            ok = ok && p->points > 0 && sscanf(rest, "%31s", word) != 1;
+        }
+        else if(strcmp(word, "dispatch") == 0) {
+            char mode[32];
+            ok = sscanf(line, "%*s %31s", mode) == 1;
+            sc->batch = ok && strcmp(mode, "batch") == 0;
+        }
+        else {
+            ok = 0;
+        }
     }
+    fclose(f);
     
-    printf("\n%s: Emergency type?\n", op);
-    printf("  C-Heart  T-Accident  R-Breathing  I-Infection  G-Other\n");
-    printf("\nYou: ");
-    scanf(" %c", &choice);
+    if(!ok) {
+        fprintf(stderr, "%s:%d: cannot parse: %s\n", path, lineNo, line);
+        freeScenario(sc);
+        return 0;
+    }
     
-    DiseaseType disease = GENERAL;
-    switch(choice) {
-        case 'C': case 'c': disease = CARDIAC; break;
-        case 'T': case 't': disease = TRAUMA; break;
-        case 'R': case 'r': disease = RESPIRATORY; break;
-        case 'I': case 'i': disease = INFECTION; break;
+    const char* error = NULL;
+    for(int i = 0; i < sc->roadCount && !error; i++)
+        if(sc->roads[i].from < 0 || sc->roads[i].from >= sc->locationCount ||
+           sc->roads[i].to < 0 || sc->roads[i].to >= sc->locationCount)
+            error = "road references an unknown location";
+    for(int i = 0; i < sc->roadCount && !error; i++)
+        if(sc->roads[i].profile < 0 || sc->roads[i].profile >= TRAFFIC_MAX_PROFILES ||
+           (sc->roads[i].profile != 0 && sc->traffic[sc->roads[i].profile].points == 0))
+            error = "road references an undefined traffic profile";
+    for(int i = 0; i < sc->hospitalCount && !error; i++)
+        if(sc->hospitals[i].location < 0 || sc->hospitals[i].location >= sc->locationCount)
+            error = "hospital references an unknown location";
+    for(int i = 0; i < sc->ambulanceCount && !error; i++)
+        if(sc->ambulances[i].location < 0 || sc->ambulances[i].location >= sc->locationCount ||
+           sc->ambulances[i].baseHospital < 0 || sc->ambulances[i].baseHospital >= sc->hospitalCount)
+            error = "ambulance references an unknown location or hospital";
+    for(int i = 0; i < sc->callCount && !error; i++)
+        if(sc->calls[i].location < 0 || sc->calls[i].location >= sc->locationCount)
+            error = "call references an unknown location";
+    for(int i = 0; i < sc->closureCount && !error; i++)
+        if(sc->closures[i].from < 0 || sc->closures[i].from >= sc->locationCount ||
+           sc->closures[i].to < 0 || sc->closures[i].to >= sc->locationCount)
+            error = "road closure references an unknown location";
+    if(!error && (sc->locationCount == 0 || sc->hospitalCount == 0 || sc->ambulanceCount == 0))
+        error = "scenario needs at least one location, hospital and ambulance";
+    
+    if(error) {
+        fprintf(stderr, "%s: %s\n", path, error);
+        freeScenario(sc);
+        return 0;
     }
     
-    printf("\n%s: Patient age?\n", op);
-    printf("You: ");
-    scanf("%d", &age);
+    qsort(sc->calls, sc->callCount, sizeof(ScenarioCall), compareCalls);
+    if(sc->closureCount > 0) qsort(sc->closures, sc->closureCount, sizeof(ScenarioClosure), compareClosures);
+    return 1;
+}
+
+// Clears every store back to an empty map at time 0
+void resetSystem() {
+    clearRoads();
+    sim->locationCount = 0;
+    sim->hospitalCount = 0;
+    sim->ambulanceCount = 0;
+    sim->activeCount = 0;
+    sim->freeActiveCount = 0;
+    sim->activeSlotCount = 0;
+    idMapClear(&sim->activeIndex);
+    
+    sim->queueSize = 0;
+    sim->freePendingCount = 0;
+    sim->pendingSlotCount = 0;
+    idMapClear(&sim->pendingIndex);
+    
+    sim->timerCount = 0;
+    sim->spatialValid = 0;
+    memset(sim->trafficProfiles, 0, sizeof(sim->trafficProfiles));
+    sim->trafficEnabled = 0;
+    sim->trafficRowsValid = 0;
+    sim->currentTime = 0;
+    sim->idleAmbulances = 0;
+    sim->nextEmergencyId = 0;
+    sim->totalHandled = 0;
+    sim->totalResponseTime = 0;
+    sim->batchOptimalMinutes = 0;
+    sim->batchGreedyMinutes = 0;
+    sim->batchRounds = 0;
+    sim->fedCalls = 0;
+    sim->fedClosures = 0;
+    memset(sim->responseMinutes, 0, sizeof(sim->responseMinutes));
+    memset(&sim->stats, 0, sizeof(sim->stats));
+}
+
+void applyScenario(const Scenario* sc) {
+    resetSystem();
+    reserveCapacity(sc->locationCount, sc->hospitalCount, sc->ambulanceCount, sc->callCount);
+    
+    for(int i = 0; i < sc->locationCount; i++)
+        addLocation(sc->locations[i].name, sc->locations[i].x, sc->locations[i].y);
+    for(int p = 1; p < TRAFFIC_MAX_PROFILES; p++)
+        if(sc->traffic[p].points > 0)
+            defineTrafficProfile(p, sc->traffic[p].points, sc->traffic[p].minute, sc->traffic[p].percent);
+    for(int i = 0; i < sc->roadCount; i++)
+        addRoad(sc->roads[i].from, sc->roads[i].to, sc->roads[i].distance);
+    for(int i = 0; i < sc->roadCount; i++)
+        if(sc->roads[i].profile != 0)
+            setRoadProfile(sc->roads[i].from, sc->roads[i].to, sc->roads[i].profile);
+    for(int i = 0; i < sc->hospitalCount; i++)
+        addHospital(sc->hospitals[i].name, sc->hospitals[i].location,
+                    sc->hospitals[i].capacity, sc->hospitals[i].specialty);
+    for(int i = 0; i < sc->ambulanceCount; i++)
+        addAmbulance(sc->ambulances[i].location, sc->ambulances[i].baseHospital);
+    
+    sim->batchDispatch = sc->batch;
+}
+
+int systemBusy() {
+    return sim->queueSize > 0 || sim->activeCount > 0 || sim->idleAmbulances < sim->ambulanceCount;
+}
+
+void writeCheckpoint(const char* path) {
+    if(!saveSnapshot(path)) fprintf(stderr, "Could not write snapshot %s\n", path);
+}
+
+// Feeds every call and road closure not fed yet in at its timestamp
+// (closures first on a tie), then runs until the fleet is back at base
+// (or a week past the last call, if some call can never be served).
+// With a checkpoint path, the run is snapshotted on reaching minute
+// checkpointAt, or after the last call if that comes first.
+// Returns 0 if the system is still busy a week after the last input,
+// e.g. a unit stuck behind a closure that never reopens.
+int feedScenario(const Scenario* sc, const char* checkpointPath, int checkpointAt) {
+    while(sim->fedCalls < sc->callCount || sim->fedClosures < sc->closureCount) {
+        int i = sim->fedCalls, k = sim->fedClosures;
+        int closureNext = k < sc->closureCount &&
+                          (i == sc->callCount || sc->closures[k].time <= sc->calls[i].time);
+        int at = closureNext ? sc->closures[k].time : sc->calls[i].time;
+        
+        if(checkpointPath && at >= checkpointAt) {
+            if(checkpointAt > sim->currentTime) advanceTime(checkpointAt - sim->currentTime);
+            writeCheckpoint(checkpointPath);
+            checkpointPath = NULL;
+        }
+        if(at > sim->currentTime) advanceTime(at - sim->currentTime);
+        
+        if(closureNext) {
+            const ScenarioClosure* c = &sc->closures[sim->fedClosures++];
+            if(c->closed) closeRoad(c->from, c->to);
+            else reopenRoad(c->from, c->to);
+        }
+        else {
+            const ScenarioCall* c = &sc->calls[sim->fedCalls++];
+            enqueueEmergency(c->caller, c->location, c->disease, c->age);
+        }
+    }
+    if(checkpointPath) writeCheckpoint(checkpointPath);
+    
+    int deadline = sim->currentTime + 7 * 24 * 60;
+    while(systemBusy() && sim->currentTime < deadline)
+        advanceTime(60);
+    return !systemBusy();
+}
+
+void runScenario(const Scenario* sc) {
+    applyScenario(sc);
+    feedScenario(sc, NULL, 0);
+}
+
+void printScenarioSummary(const char* path, const Scenario* sc, double wallMs) {
+    int totalBeds = 0, usedBeds = 0;
+    for(int i = 0; i < sim->hospitalCount; i++) {
+        totalBeds += sim->hospitals[i].capacity;
+        usedBeds += sim->hospitals[i].patients;
+    }
+    
+    printf("\nSCENARIO SUMMARY\n\n");
+    printf("  Scenario: %s\n", path);
+    printf("  Map: %d locations, %d roads, %d hospitals, %d ambulances\n",
+           sim->locationCount, sim->roadCount / 2, sim->hospitalCount, sim->ambulanceCount);
+    printf("  Dispatch Mode: %s\n", sim->batchDispatch ? "batch" : "greedy");
+    printf("  Calls: %d\n", sc->callCount);
+    printf("  Handled: %d\n", sim->totalHandled);
+    printf("  Still Pending: %d\n", sim->queueSize);
+    printf("  Still Active: %d\n", sim->activeCount);
+    printf("  Simulated Time: %d minutes\n", sim->currentTime);
+    if(sim->totalHandled > 0)
+        printf("  Average Response Time: %.2f minutes\n", (float)sim->totalResponseTime / sim->totalHandled);
+    if(sim->batchRounds > 0)
+        printf("  Batch Travel Time: %ld min (greedy on the same calls %ld min)\n",
+               sim->batchOptimalMinutes, sim->batchGreedyMinutes);
+    printf("  Hospital Bed Usage: %d/%d\n", usedBeds, totalBeds);
+    printf("  Wall Time: %.3f ms\n\n", wallMs);
+}
+
+double wallClockMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+// With `restore`, the run resumes from that snapshot of the same
+// scenario instead of starting over
+int runHeadless(const char* path, int verbose, int forceBatch, int stats,
+                const char* restore, const char* checkpoint, int checkpointAt, const char* journal) {
+    Scenario sc;
+    if(!loadScenario(path, &sc)) return 1;
+    if(forceBatch) sc.batch = 1;
+    
+    static char outBuf[1 << 16];
+    setvbuf(stdout, outBuf, _IOFBF, sizeof(outBuf));
+    sim->simLogEnabled = verbose;
+    
+    double start = wallClockMs();
+    if(restore) {
+        if(!loadSnapshot(restore) || sim->fedCalls > sc.callCount || sim->fedClosures > sc.closureCount) {
+            fprintf(stderr, "Cannot restore %s\n", restore);
+            freeScenario(&sc);
+            return 1;
+        }
+    }
+    else applyScenario(&sc);
+    if(journal && !journalOpen(journal)) {
+        fprintf(stderr, "Cannot write journal %s\n", journal);
+        freeScenario(&sc);
+        return 1;
+    }
+    int drained = feedScenario(&sc, checkpoint, checkpointAt);
+    journalClose();
+    double wallMs = wallClockMs() - start;
+    logFlush();
+    
+    printScenarioSummary(path, &sc, wallMs);
+    if(stats) printStatsSnapshot(stdout);
+    freeScenario(&sc);
+    if(!drained) {
+        fflush(stdout);
+        fprintf(stderr, "Scenario did not drain: %d calls pending, %d active a week after the last input\n",
+                sim->queueSize, sim->activeCount);
+        return 1;
+    }
+    return 0;
+}
+
+void setupDefaultSystem();
+
+// Starting state for a replay or a server: a snapshot, a scenario's map
+// (its calls are not fed), or the console's default map
+int setupBaseState(const char* scenario, const char* restore) {
+    if(restore) {
+        if(!loadSnapshot(restore)) {
+            fprintf(stderr, "Cannot restore %s\n", restore);
+            return 0;
+        }
+    }
+    else if(scenario) {
+        Scenario sc;
+        if(!loadScenario(scenario, &sc)) return 0;
+        applyScenario(&sc);
+        freeScenario(&sc);
+    }
+    else setupDefaultSystem();
+    return 1;
+}
+
+// Rebuilds a run from its journal, starting from a snapshot, a scenario's
+// map, or the console's default map, and reports where it ended up. The
+// replayed run keeps its timing stats, for profiling recorded shifts.
+int runReplay(const char* path, const char* scenario, const char* restore,
+              int verbose, int stats, const char* checkpoint) {
+    if(!setupBaseState(scenario, restore)) return 1;
+    if(!journalReplayOpen(path)) return 1;
+    static char outBuf[1 << 16];
+    setvbuf(stdout, outBuf, _IOFBF, sizeof(outBuf));
+    sim->simLogEnabled = verbose;
+    
+    double start = wallClockMs();
+    int ok = replayJournal();
+    double wallMs = wallClockMs() - start;
+    logFlush();
+    
+    printf("\nREPLAY %s\n", path);
+    printf("  Records checked: %ld%s\n", sim->journal.replayChecked, ok ? "" : " (diverged)");
+    printf("  Time reached: %d minutes\n", sim->currentTime);
+    printf("  Emergencies handled: %d\n", sim->totalHandled);
+    printf("  Still pending: %d | Active: %d\n", sim->queueSize, sim->activeCount);
+    printf("  Wall Time: %.3f ms\n", wallMs);
+    if(stats) printStatsSnapshot(stdout);
+    journalReplayClose();
+    
+    if(checkpoint) writeCheckpoint(checkpoint);
+    return ok ? 0 : 1;
+}
+
+
+//Monte Carlo Runner
+
+// Replications of one scenario spread over a pool of worker threads.
+// Workers claim run numbers from a shared counter; each keeps its own
+// context and totals, which are merged after the pool joins.
+typedef struct {
+    const Scenario* scenario;
+    int runs;
+    unsigned long long seed;
+    atomic_int nextRun;
+} MonteCarloJob;
+
+typedef struct {
+    MonteCarloJob* job;
+    pthread_t thread;
+    long responseMinutes[RESPONSE_HIST_SIZE];
+    double sumMeanResponse;
+    double sumSqMeanResponse;
+    long handled;
+    long unserved;
+    int runs;
+} MonteCarloWorker;
+
+// Distinct, well-spread starting state for run `run` of a job
+unsigned long long seedForRun(unsigned long long seed, int run) {
+    unsigned long long z = seed + (unsigned long long)(run + 1) * 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+void* monteCarloWorker(void* arg) {
+    MonteCarloWorker* w = arg;
+    MonteCarloJob* job = w->job;
+    
+    sim = createSimContext(0);
+    sim->simLogEnabled = 0;
+    sim->statsTiming = 0;
+    
+    int run;
+    while((run = atomic_fetch_add(&job->nextRun, 1)) < job->runs) {
+        sim->rngState = seedForRun(job->seed, run);
+        runScenario(job->scenario);
+        
+        for(int b = 0; b < RESPONSE_HIST_SIZE; b++)
+            w->responseMinutes[b] += sim->responseMinutes[b];
+        
+        double mean = sim->totalHandled > 0 ? (double)sim->totalResponseTime / sim->totalHandled : 0;
+        w->sumMeanResponse += mean;
+        w->sumSqMeanResponse += mean * mean;
+        w->handled += sim->totalHandled;
+        w->unserved += sim->queueSize + sim->activeCount;
+        w->runs++;
+    }
+    
+    destroySimContext(sim);
+    sim = NULL;
+    return NULL;
+}
+
+int histogramPercentile(const long* hist, long total, double fraction) {
+    long target = (long)ceil(total * fraction);
+    long seen = 0;
+    for(int b = 0; b < RESPONSE_HIST_SIZE; b++) {
+        seen += hist[b];
+        if(seen >= target && seen > 0) return b;
+    }
+    return RESPONSE_HIST_SIZE - 1;
+}
+
+int runMonteCarlo(const char* path, int runs, int threads, unsigned long long seed, int forceBatch) {
+    Scenario sc;
+    if(!loadScenario(path, &sc)) return 1;
+    if(forceBatch) sc.batch = 1;
+    
+    if(threads < 1) threads = 1;
+    if(threads > runs) threads = runs;
+    
+    // The scenario is shared read-only by all workers; every worker's
+    // context builds its own copy of the map and has its own RNG.
+    MonteCarloJob job;
+    job.scenario = &sc;
+    job.runs = runs;
+    job.seed = seed;
+    atomic_init(&job.nextRun, 0);
+    
+    MonteCarloWorker* workers = calloc(threads, sizeof(MonteCarloWorker));
+    if(!workers) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    
+    // Runs are claimed from job.nextRun, so the workers that did start
+    // share out the runs of any that could not; with none, this thread
+    // does them all
+    double start = wallClockMs();
+    int started = 0;
+    for(int t = 0; t < threads; t++) {
+        workers[started].job = &job;
+        if(pthread_create(&workers[started].thread, NULL, monteCarloWorker, &workers[started]) != 0) break;
+        started++;
+    }
+    if(started < threads)
+        fprintf(stderr, "Could only start %d of %d worker threads\n", started, threads);
+    if(started == 0) {
+        workers[0].job = &job;
+        monteCarloWorker(&workers[0]);
+    }
+    
+    long hist[RESPONSE_HIST_SIZE] = {0};
+    double sumMean = 0, sumSqMean = 0;
+    long handled = 0, unserved = 0;
+    for(int t = 0; t < (started > 0 ? started : 1); t++) {
+        if(started > 0) pthread_join(workers[t].thread, NULL);
+        for(int b = 0; b < RESPONSE_HIST_SIZE; b++) hist[b] += workers[t].responseMinutes[b];
+        sumMean += workers[t].sumMeanResponse;
+        sumSqMean += workers[t].sumSqMeanResponse;
+        handled += workers[t].handled;
+        unserved += workers[t].unserved;
+    }
+    double wallMs = wallClockMs() - start;
+    
+    long arrivals = 0, weighted = 0;
+    for(int b = 0; b < RESPONSE_HIST_SIZE; b++) {
+        arrivals += hist[b];
+        weighted += (long)b * hist[b];
+    }
+    
+    double mean = sumMean / runs;
+    double variance = sumSqMean / runs - mean * mean;
+    
+    printf("\nMONTE CARLO SUMMARY\n\n");
+    printf("  Scenario: %s\n", path);
+    printf("  Runs: %d on %d threads (seed %llu)\n", runs, started > 0 ? started : 1, seed);
+    printf("  Dispatch Mode: %s\n", sc.batch ? "batch" : "greedy");
+    printf("  Calls Handled: %ld (%ld left unserved)\n", handled, unserved);
+    printf("  Travel Response per Run: mean %.2f min, sd %.2f\n",
+           mean, variance > 0 ? sqrt(variance) : 0.0);
+    if(arrivals > 0) {
+        printf("  Call-to-Scene Time: mean %.2f min\n", (double)weighted / arrivals);
+        printf("    p50 %d  p90 %d  p95 %d  p99 %d min%s\n",
+               histogramPercentile(hist, arrivals, 0.50),
+               histogramPercentile(hist, arrivals, 0.90),
+               histogramPercentile(hist, arrivals, 0.95),
+               histogramPercentile(hist, arrivals, 0.99),
+               hist[RESPONSE_HIST_SIZE - 1] > 0 ? " (last bucket is open-ended)" : "");
+    }
+    printf("  Wall Time: %.1f ms (%.0f runs/s)\n\n", wallMs, runs / (wallMs / 1000.0));
+    
+    free(workers);
+    freeScenario(&sc);
+    return 0;
+}
+
+//Benchmarks
+
+// Synthetic cities for measuring the dispatch hot paths at scale:
+//   grid - square lattice, 4-neighbour roads of 2-4 minutes
+//   geo  - random geometric graph, each node joined to its 4 nearest
+typedef struct {
+    const char* name;
+    double* samples;
+    int count, cap;
+} BenchSeries;
+
+double nowMicros() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+void benchRecord(BenchSeries* b, double micros) {
+    b->samples = reserveArray(b->samples, &b->cap, b->count + 1, sizeof(double));
+    b->samples[b->count++] = micros;
+}
+
+int compareDoubles(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+void benchReport(BenchSeries* b) {
+    if(b->count == 0) return;
+    qsort(b->samples, b->count, sizeof(double), compareDoubles);
+    
+    double sum = 0;
+    for(int i = 0; i < b->count; i++) sum += b->samples[i];
+    double mean = sum / b->count;
+    
+    printf("  %-26s %8d %11.2f %10.2f %10.2f %10.2f %10.2f %12.0f\n",
+           b->name, b->count, mean,
+           b->samples[(int)(b->count * 0.50)],
+           b->samples[(int)(b->count * 0.90)],
+           b->samples[(int)(b->count * 0.99)],
+           b->samples[b->count - 1],
+           mean > 0 ? 1e6 / mean : 0);
+    
+    free(b->samples);
+    b->samples = NULL;
+    b->count = b->cap = 0;
+}
+
+void generateGridCity(int nodes) {
+    int side = (int)ceil(sqrt((double)nodes));
+    char name[50];
+    
+    reserveCapacity(nodes, 0, 0, 0);
+    for(int i = 0; i < nodes; i++) {
+        snprintf(name, sizeof(name), "Node %d", i);
+        addLocation(name, (i % side) * 2, (i / side) * 2);
+    }
+    for(int i = 0; i < nodes; i++) {
+        if(i % side + 1 < side && i + 1 < nodes) addRoad(i, i + 1, 2 + simRandom() % 3);
+        if(i + side < nodes) addRoad(i, i + side, 2 + simRandom() % 3);
+    }
+}
+
+typedef struct {
+    int cells, cellSize;
+    int* cellStart;
+    int* cellItems;
+} PointGrid;
+
+void buildPointGrid(PointGrid* g, int nodes, int cells, int cellSize) {
+    g->cells = cells;
+    g->cellSize = cellSize;
+    g->cellStart = calloc((size_t)cells * cells + 1, sizeof(int));
+    g->cellItems = malloc(nodes * sizeof(int));
+    
+    for(int i = 0; i < nodes; i++) {
+        int c = (sim->locations[i].y / cellSize) * cells + sim->locations[i].x / cellSize;
+        g->cellStart[c + 1]++;
+    }
+    for(int c = 0; c < cells * cells; c++) g->cellStart[c + 1] += g->cellStart[c];
+    
+    int* fill = malloc((size_t)cells * cells * sizeof(int));
+    memcpy(fill, g->cellStart, (size_t)cells * cells * sizeof(int));
+    for(int i = 0; i < nodes; i++) {
+        int c = (sim->locations[i].y / cellSize) * cells + sim->locations[i].x / cellSize;
+        g->cellItems[fill[c]++] = i;
+    }
+    free(fill);
+}
+
+int findRoot(int* parent, int v) {
+    while(parent[v] != v) {
+        parent[v] = parent[parent[v]];
+        v = parent[v];
+    }
+    return v;
+}
+
+// Up to k nearest points to i, nearest first, searched ring by ring. If
+// parent is given, only points whose component root is `root` count.
+int nearestPoints(PointGrid* g, int i, int k, int best[], int bestD[], int* parent, int root) {
+    int found = 0;
+    int cx = sim->locations[i].x / g->cellSize, cy = sim->locations[i].y / g->cellSize;
+    
+    // One extra ring after the first hit: a closer point can sit in the
+    // next ring out when the query is near its own cell's edge
+    for(int ring = 0, extra = -1; ring < g->cells && extra != 0; ring++) {
+        for(int y = cy - ring; y <= cy + ring; y++) {
+            for(int x = cx - ring; x <= cx + ring; x++) {
+                if(x < 0 || y < 0 || x >= g->cells || y >= g->cells) continue;
+                if(abs(x - cx) < ring && abs(y - cy) < ring) continue;
+                int c = y * g->cells + x;
+                for(int t = g->cellStart[c]; t < g->cellStart[c + 1]; t++) {
+                    int j = g->cellItems[t];
+                    if(j == i || (parent && findRoot(parent, j) != root)) continue;
+                    int dx = sim->locations[i].x - sim->locations[j].x;
+                    int dy = sim->locations[i].y - sim->locations[j].y;
+                    int d = dx * dx + dy * dy;
+                    if(found == k && d >= bestD[k - 1]) continue;
+                    int slot = found < k ? found++ : k - 1;
+                    while(slot > 0 && bestD[slot - 1] > d) {
+                        best[slot] = best[slot - 1];
+                        bestD[slot] = bestD[slot - 1];
+                        slot--;
+                    }
+                    best[slot] = j;
+                    bestD[slot] = d;
+                }
+            }
+        }
+        if(extra > 0) extra--;
+        else if(extra < 0 && found == k) extra = 1;
+    }
+    return found;
+}
+
+void addGeoRoad(int* parent, int a, int b, int squaredDist) {
+    addRoad(a, b, 1 + (int)ceil(sqrt((double)squaredDist)));
+    parent[findRoot(parent, a)] = findRoot(parent, b);
+}
+
+void generateGeometricCity(int nodes) {
+    int side = (int)ceil(sqrt((double)nodes));
+    int cellSize = 2;
+    char name[50];
+    
+    reserveCapacity(nodes, 0, 0, 0);
+    for(int i = 0; i < nodes; i++) {
+        snprintf(name, sizeof(name), "Node %d", i);
+        addLocation(name, simRandom() % (side * cellSize), simRandom() % (side * cellSize));
+    }
+    
+    PointGrid g;
+    buildPointGrid(&g, nodes, side, cellSize);
+    
+    const int k = 4;
+    int* knn = malloc((size_t)nodes * k * sizeof(int));
+    int* knnD = malloc((size_t)nodes * k * sizeof(int));
+    int* knnCount = malloc(nodes * sizeof(int));
+    int* parent = malloc(nodes * sizeof(int));
+    for(int i = 0; i < nodes; i++) {
+        parent[i] = i;
+        knnCount[i] = nearestPoints(&g, i, k, &knn[i * k], &knnD[i * k], NULL, 0);
+    }
+    
+    // Road i-j if either end lists the other, added once
+    for(int i = 0; i < nodes; i++) {
+        for(int n = 0; n < knnCount[i]; n++) {
+            int j = knn[i * k + n];
+            int mutual = 0;
+            for(int m = 0; m < knnCount[j]; m++)
+                if(knn[j * k + m] == i) mutual = 1;
+            if(!mutual || j > i) addGeoRoad(parent, i, j, knnD[i * k + n]);
+        }
+    }
+    
+    // Join stray clusters to node 0's component through their nearest
+    // member, so every call is reachable
+    for(int i = 1; i < nodes; i++) {
+        int root = findRoot(parent, 0);
+        if(findRoot(parent, i) == root) continue;
+        int j, d;
+        if(nearestPoints(&g, i, 1, &j, &d, parent, root) == 1)
+            addGeoRoad(parent, i, j, d);
+    }
+    
+    free(knn); free(knnD); free(knnCount); free(parent);
+    free(g.cellStart); free(g.cellItems);
+}
+
+int benchRandomLocation() {
+    return simRandom() % sim->locationCount;
+}
+
+// Morning and evening rush on every other road, starting the clock at 8:00
+void addBenchTraffic() {
+    const int minute[] = { 360, 480, 600, 960, 1050, 1200 };
+    const int percent[] = { 100, 250, 120, 120, 220, 100 };
+    defineTrafficProfile(1, 6, minute, percent);
+    
+    for(int from = 0; from < sim->locationCount; from++)
+        for(Road* r = sim->roads[from]; r != NULL; r = r->next)
+            if(from < r->destination && (from + r->destination) % 2 == 0)
+                setRoadProfile(from, r->destination, 1);
+    sim->currentTime = 480;
+}
+
+int runBenchmark(const char* kind, int nodes, int units, int hospitalsWanted, int calls,
+                 int samples, int traffic, unsigned long long seed) {
+    sim = createSimContext(seed);
+    sim->simLogEnabled = 0;
+    
+    double start = nowMicros();
+    if(strcmp(kind, "geo") == 0) generateGeometricCity(nodes);
+    else if(strcmp(kind, "grid") == 0) generateGridCity(nodes);
+    else {
+        fprintf(stderr, "Unknown city kind '%s' (use grid or geo)\n", kind);
+        return 1;
+    }
+    double genMicros = nowMicros() - start;
+    
+    reserveCapacity(nodes, hospitalsWanted, units, calls);
+    char name[50];
+    for(int h = 0; h < hospitalsWanted; h++) {
+        snprintf(name, sizeof(name), "Hospital %d", h);
+        addHospital(name, benchRandomLocation(), 1 << 20, (DiseaseType)(1 + h % 5));
+    }
+    for(int u = 0; u < units; u++)
+        addAmbulance(benchRandomLocation(), u % hospitalsWanted);
+    if(traffic) addBenchTraffic();
+    
+    printf("\nBENCHMARK %s city: %d nodes, %d roads, %d hospitals, %d units (seed %llu)\n",
+           kind, sim->locationCount, sim->roadCount / 2, sim->hospitalCount, sim->ambulanceCount, seed);
+    printf("  Generated in %.1f ms; latencies in microseconds%s\n\n", genMicros / 1000,
+           traffic ? "; rush-hour traffic on half the roads" : "");
+    printf("  %-26s %8s %11s %10s %10s %10s %10s %12s\n",
+           "operation", "samples", "mean", "p50", "p90", "p99", "max", "ops/s");
+    
+    BenchSeries b = { "build road graph (CSR)", NULL, 0, 0 };
+    start = nowMicros();
+    buildRoadGraph();
+    benchRecord(&b, nowMicros() - start);
+    benchReport(&b);
+    
+    if(sim->locationCount <= DIST_MATRIX_MAX_LOCATIONS) {
+        b.name = "build distance matrix";
+        start = nowMicros();
+        buildDistanceMatrix();
+        benchRecord(&b, nowMicros() - start);
+        benchReport(&b);
+    }
+    
+    int* dist = malloc(sim->locationCount * sizeof(int));
+    b.name = "shortestPathTree";
+    for(int i = 0; i < samples && i < 200; i++) {
+        int from = benchRandomLocation();
+        start = nowMicros();
+        shortestPathTree(from, -1, dist, NULL);
+        benchRecord(&b, nowMicros() - start);
+    }
+    benchReport(&b);
+    free(dist);
+    
+    // Landmarks and hierarchy are built before findShortestPath, which
+    // would otherwise build them lazily inside its first sample
+    b.name = "build ALT landmarks";
+    start = nowMicros();
+    buildLandmarks();
+    benchRecord(&b, nowMicros() - start);
+    benchReport(&b);
+    
+    // Contraction dwarfs everything else on big maps, so it only runs
+    // when the hierarchy is asked for
+    int withHierarchy = sim->routing == ROUTE_CH || sim->chFile;
+    if(withHierarchy) {
+        b.name = "build contraction hierarchy";
+        start = nowMicros();
+        buildContractionHierarchy();
+        allocateHierarchyQuery();
+        benchRecord(&b, nowMicros() - start);
+        benchReport(&b);
+        printf("    (%d upward edges, %.2f per node)\n", sim->chUpCount, (double)sim->chUpCount / sim->locationCount);
+    }
+    
+    if(withHierarchy && sim->chFile) {
+        b.name = "save hierarchy";
+        start = nowMicros();
+        if(!saveContractionHierarchy(sim->chFile)) fprintf(stderr, "Could not write %s\n", sim->chFile);
+        benchRecord(&b, nowMicros() - start);
+        benchReport(&b);
+        
+        b.name = "load hierarchy";
+        start = nowMicros();
+        if(!loadContractionHierarchy(sim->chFile)) fprintf(stderr, "Could not read %s\n", sim->chFile);
+        benchRecord(&b, nowMicros() - start);
+        benchReport(&b);
+    }
+    
+    b.name = "findShortestPath";
+    for(int i = 0; i < samples; i++) {
+        int from = benchRandomLocation(), to = benchRandomLocation();
+        start = nowMicros();
+        findShortestPath(from, to);
+        benchRecord(&b, nowMicros() - start);
+    }
+    benchReport(&b);
+    
+    // The same query pairs under each point-to-point search
+    int* pairs = malloc(2 * samples * sizeof(int));
+    int* answers = malloc(samples * sizeof(int));
+    for(int i = 0; i < 2 * samples; i++) pairs[i] = benchRandomLocation();
+    
+    const char* routeNames[] = { "route: Dijkstra", "route: A*", "route: ALT", "route: CH" };
+    RoutingMode savedRouting = sim->routing;
+    int mismatches = 0;
+    // The hierarchy only knows free-flow minutes, so it sits out with traffic
+    int lastMode = withHierarchy && !sim->trafficEnabled ? ROUTE_CH : ROUTE_ALT;
+    for(int mode = ROUTE_DIJKSTRA; mode <= lastMode; mode++) {
+        sim->routing = mode;
+        long settledBefore = sim->stats.shortestPathSettled;
+        b.name = routeNames[mode];
+        for(int i = 0; i < samples; i++) {
+            start = nowMicros();
+            int d = mode == ROUTE_DIJKSTRA ? shortestPathTo(pairs[2*i], pairs[2*i + 1])
+                  : mode == ROUTE_CH       ? chDistance(pairs[2*i], pairs[2*i + 1])
+                                           : guidedPathTo(pairs[2*i], pairs[2*i + 1]);
+            benchRecord(&b, nowMicros() - start);
+            if(mode == ROUTE_DIJKSTRA) answers[i] = d;
+            else if(d != answers[i]) mismatches++;
+        }
+        int queries = b.count;
+        benchReport(&b);
+        if(queries > 0)
+            printf("    (%.0f nodes settled per query)\n",
+                   (double)(sim->stats.shortestPathSettled - settledBefore) / queries);
+    }
+    sim->routing = savedRouting;
+    if(mismatches > 0) printf("  WARNING: %d routes differ from Dijkstra\n", mismatches);
+    free(pairs);
+    free(answers);
+    
+    b.name = "findBestHospital";
+    for(int i = 0; i < samples; i++) {
+        int loc = benchRandomLocation();
+        start = nowMicros();
+        findBestHospital(loc, (DiseaseType)(1 + simRandom() % 5));
+        benchRecord(&b, nowMicros() - start);
+    }
+    benchReport(&b);
+    
+    b.name = "findNearestIdleAmbulance";
+    for(int i = 0; i < samples; i++) {
+        int loc = benchRandomLocation();
+        start = nowMicros();
+        findNearestIdleAmbulance(loc);
+        benchRecord(&b, nowMicros() - start);
+    }
+    benchReport(&b);
+    
+    b.name = "enqueueEmergency";
+    for(int i = 0; i < calls; i++) {
+        int loc = benchRandomLocation();
+        DiseaseType d = (DiseaseType)(1 + simRandom() % 5);
+        int age = simRandom() % 95;
+        start = nowMicros();
+        enqueueEmergency("Bench", loc, d, age);
+        benchRecord(&b, nowMicros() - start);
+    }
+    benchReport(&b);
     
-    enqueueEmergency(name, loc, disease, age);
+    b.name = "dequeueEmergency";
+    while(sim->queueSize > 0) {
+        start = nowMicros();
+        dequeueEmergency();
+        benchRecord(&b, nowMicros() - start);
+    }
+    benchReport(&b);
     
-    printf("\n%s: Help is coming, %s!\n", op, name);
-    printf("  Call ID: #%03d\n", nextEmergencyId - 1);
+    // Call stream: Poisson-ish arrivals spread over one simulated day,
+    // timing each one-minute advanceTime step
+    b.name = "advanceTime(1)";
+    int horizon = 24 * 60;
+    int fed = 0;
+    double simStart = nowMicros();
+    while(sim->currentTime < horizon || (systemBusy() && sim->currentTime < horizon * 2)) {
+        while(fed < calls && (long)fed * horizon < (long)calls * sim->currentTime) {
+            enqueueEmergency("Bench", benchRandomLocation(), (DiseaseType)(1 + simRandom() % 5), simRandom() % 95);
+            fed++;
+        }
+        start = nowMicros();
+        advanceTime(1);
+        benchRecord(&b, nowMicros() - start);
+    }
+    double simMicros = nowMicros() - simStart;
+    benchReport(&b);
     
-    advanceTime(2);
+    printf("\n  Simulated %d minutes with %d calls in %.1f ms (%d handled, %d still queued)\n\n",
+           sim->currentTime, fed, simMicros / 1000, sim->totalHandled, sim->queueSize);
+    
+    destroySimContext(sim);
+    sim = NULL;
+    return 0;
 }
 
-void viewSystemStatus() {
-    printf("\nSYSTEM STATUS OVERVIEW\n");
-    printf("\n\n");
-    
-    if(activeCount == 0 && queueSize == 0) {
-        printf("  No emergencies.\n");
-    } else {
-        if(activeCount > 0) {
-            printf("  Active Emergencies:\n");
-            for(int i = 0; i < activeCount; i++)
-                printf("    - %s at %s (Unit-%d)\n", 
-                       activeEmergencies[i].caller,
-                       locations[activeEmergencies[i].location].name,
-                       activeEmergencies[i].assignedAmbulance + 1);
+//HTTP Server
+
+// JSON API for the web dashboard (api-client.js), served from the live
+// state by a single-threaded epoll loop on 127.0.0.1. The simulation only
+// moves when a client asks it to, so requests never race with it.
+// Dashboards can also subscribe to pushed changes instead of polling.
+// Responses are serialized straight into the connection's output buffer,
+// which is reused across requests and only grows when a response is
+// larger than any before it; serving a request allocates nothing.
+typedef struct {
+    char* data;
+    size_t len, cap;
+    // No comma is due before the next value
+    int first;
+} JsonWriter;
+
+typedef struct {
+    int fd;
+    char* in;
+    int inLen, inCap;
+    JsonWriter out;
+    size_t outSent;
+    int closeAfter;
+    // Position + 1 in subscribers, 0 for plain requests
+    int subscriber;
+} HttpConn;
+
+volatile sig_atomic_t serverStop = 0;
+
+void jsonReserve(JsonWriter* w, size_t extra) {
+    if(w->len + extra <= w->cap) return;
+    size_t cap = w->cap ? w->cap : 4096;
+    while(cap < w->len + extra) cap *= 2;
+    char* grown = realloc(w->data, cap);
+    if(!grown) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    w->data = grown;
+    w->cap = cap;
+}
+
+void jsonRaw(JsonWriter* w, const char* s, size_t n) {
+    jsonReserve(w, n);
+    memcpy(w->data + w->len, s, n);
+    w->len += n;
+}
+
+void jsonSeparate(JsonWriter* w) {
+    if(!w->first) {
+        jsonReserve(w, 1);
+        w->data[w->len++] = ',';
+    }
+    w->first = 0;
+}
+
+void jsonOpen(JsonWriter* w, char bracket) {
+    jsonSeparate(w);
+    jsonRaw(w, &bracket, 1);
+    w->first = 1;
+}
+
+void jsonClose(JsonWriter* w, char bracket) {
+    jsonRaw(w, &bracket, 1);
+    w->first = 0;
+}
+
+void jsonString(JsonWriter* w, const char* s) {
+    jsonSeparate(w);
+    jsonReserve(w, 2 + 6 * strlen(s));
+    char* out = w->data + w->len;
+    *out++ = '"';
+    for(; *s; s++) {
+        unsigned char c = *s;
+        if(c == '"' || c == '\\') {
+            *out++ = '\\';
+            *out++ = c;
         }
-        
-        if(queueSize > 0) {
-            printf("\n  Waiting:\n");
-            for(int i = 0; i < queueSize && i < 3; i++)
-                printf("    - %s (Priority %d)\n",
-                       pendingQueue[i].caller, pendingQueue[i].priority);
-            if(queueSize > 3)
-                printf("    ... +%d more\n", queueSize - 3);
+        else if(c < 0x20) {
+            static const char hex[] = "0123456789abcdef";
+            memcpy(out, "\\u00", 4);
+            out[4] = hex[c >> 4];
+            out[5] = hex[c & 15];
+            out += 6;
         }
+        else *out++ = c;
     }
+    *out++ = '"';
+    w->len = out - w->data;
+}
+
+// Object key; the value written next goes without a comma
+void jsonKey(JsonWriter* w, const char* key) {
+    jsonString(w, key);
+    jsonRaw(w, ":", 1);
+    w->first = 1;
+}
+
+void jsonInt(JsonWriter* w, long v) {
+    jsonSeparate(w);
+    char digits[24];
+    int n = 0;
+    unsigned long u = v < 0 ? -(unsigned long)v : (unsigned long)v;
+    do {
+        digits[n++] = '0' + u % 10;
+        u /= 10;
+    } while(u);
+    if(v < 0) digits[n++] = '-';
     
-    printf("\n  Stats: %d handled", totalHandled);
-    if(totalHandled > 0)
-        printf(", avg response %.1f min", (float)totalResponseTime / totalHandled);
-    printf("\n\n");
+    jsonReserve(w, n);
+    while(n > 0) w->data[w->len++] = digits[--n];
 }
 
-void viewHospitalStatus() {
-    printf("\nHOSPITAL STATUS\n");
-    printf("\n\n");
+void jsonDouble(JsonWriter* w, double v) {
+    jsonSeparate(w);
+    jsonReserve(w, 32);
+    w->len += snprintf(w->data + w->len, 32, "%.2f", v);
+}
+
+void jsonBool(JsonWriter* w, int v) {
+    jsonSeparate(w);
+    if(v) jsonRaw(w, "true", 4);
+    else jsonRaw(w, "false", 5);
+}
+
+void jsonFieldInt(JsonWriter* w, const char* key, long v) {
+    jsonKey(w, key);
+    jsonInt(w, v);
+}
+
+void jsonFieldString(JsonWriter* w, const char* key, const char* v) {
+    jsonKey(w, key);
+    jsonString(w, v);
+}
+
+const char* unitStateCode(int state) {
+    const char* codes[] = { "IDLE", "TO_EMERGENCY", "AT_SCENE", "TO_HOSPITAL", "RETURNING" };
+    return state >= IDLE && state <= RETURNING ? codes[state] : "IDLE";
+}
+
+void jsonAmbulance(JsonWriter* w, int i) {
+    const Ambulance* a = &sim->ambulances[i];
+    jsonOpen(w, '{');
+    jsonFieldInt(w, "ambulanceId", a->id);
+    jsonFieldString(w, "state", unitStateCode(sim->unitState[i]));
+    jsonFieldInt(w, "location", sim->unitLocation[i]);
+    jsonFieldInt(w, "availableAt", sim->unitAvailableAt[i]);
+    jsonFieldInt(w, "targetEmergency", a->targetEmergency);
+    jsonFieldInt(w, "targetHospital", a->targetHospital);
+    jsonFieldInt(w, "estimatedArrival", a->estimatedArrival);
+    jsonFieldInt(w, "baseHospital", a->baseHospital);
+    jsonClose(w, '}');
+}
+
+void jsonEmergency(JsonWriter* w, const Emergency* e, const char* status) {
+    jsonOpen(w, '{');
+    jsonFieldInt(w, "emergencyId", e->id);
+    jsonFieldString(w, "caller", e->caller);
+    jsonFieldInt(w, "location", e->location);
+    jsonFieldInt(w, "disease", e->disease);
+    jsonFieldInt(w, "age", e->age);
+    jsonFieldInt(w, "priority", e->priority);
+    jsonFieldInt(w, "assignedAmbulance", e->assignedAmbulance);
+    jsonKey(w, "canReassign");
+    jsonBool(w, e->canReassign);
+    jsonFieldInt(w, "reportTime", e->reportTime);
+    jsonFieldInt(w, "serviceTime", e->serviceTime);
+    jsonFieldString(w, "status", status);
+    jsonClose(w, '}');
+}
+
+// Call `id` wherever it is now, with its status; NULL once it has left
+// the system
+const Emergency* lookupEmergency(int id, const char** status) {
+    int slot = idMapGet(&sim->pendingIndex, id);
+    if(slot != -1) {
+        *status = "pending";
+        return &sim->pendingRecords[slot];
+    }
+    *status = "active";
+    return findActiveEmergency(id);
+}
+
+void jsonHospital(JsonWriter* w, int h) {
+    const Hospital* hosp = &sim->hospitals[h];
+    jsonOpen(w, '{');
+    jsonFieldInt(w, "hospitalId", h);
+    jsonFieldString(w, "name", hosp->name);
+    jsonFieldInt(w, "location", hosp->location);
+    jsonFieldInt(w, "capacity", hosp->capacity);
+    jsonFieldInt(w, "currentPatients", hosp->patients);
+    jsonFieldInt(w, "specialty", hosp->specialty);
+    jsonClose(w, '}');
+}
+
+void jsonSystemState(JsonWriter* w) {
+    jsonOpen(w, '{');
+    jsonFieldInt(w, "currentTime", sim->currentTime);
+    jsonFieldInt(w, "nextEmergencyId", sim->nextEmergencyId);
+    jsonFieldInt(w, "totalHandled", sim->totalHandled);
+    jsonFieldInt(w, "totalResponseTime", sim->totalResponseTime);
+    jsonFieldInt(w, "pendingEmergencies", sim->queueSize);
+    jsonFieldInt(w, "activeEmergencies", sim->activeCount);
+    jsonFieldInt(w, "idleAmbulances", sim->idleAmbulances);
+    jsonFieldInt(w, "totalAmbulances", sim->ambulanceCount);
+    jsonFieldInt(w, "closedRoads", sim->closedRoads);
+    jsonKey(w, "batchDispatch");
+    jsonBool(w, sim->batchDispatch);
+    jsonClose(w, '}');
+}
+
+// Minutes within which `fraction` of arrivals on scene happened
+int responsePercentile(double fraction) {
+    long total = 0, seen = 0;
+    for(int m = 0; m < RESPONSE_HIST_SIZE; m++) total += sim->responseMinutes[m];
+    for(int m = 0; m < RESPONSE_HIST_SIZE; m++) {
+        seen += sim->responseMinutes[m];
+        if(total > 0 && seen >= fraction * total) return m;
+    }
+    return 0;
+}
+
+void jsonStats(JsonWriter* w) {
+    const SimStats* st = &sim->stats;
+    jsonOpen(w, '{');
+    jsonFieldInt(w, "currentTime", sim->currentTime);
+    jsonFieldInt(w, "totalHandled", sim->totalHandled);
+    jsonKey(w, "averageResponseTime");
+    jsonDouble(w, sim->totalHandled > 0 ? (double)sim->totalResponseTime / sim->totalHandled : 0);
+    jsonFieldInt(w, "responseP50", responsePercentile(0.5));
+    jsonFieldInt(w, "responseP90", responsePercentile(0.9));
+    jsonFieldInt(w, "queueWaitP90", histPercentile(&st->queueWaitMinutes, 0.9));
+    jsonFieldInt(w, "dispatches", st->dispatches);
+    jsonFieldInt(w, "requeues", st->requeues);
+    jsonFieldInt(w, "reassignments", st->reassignments);
+    jsonFieldInt(w, "reassignMinutesSaved", st->reassignMinutesSaved);
+    jsonFieldInt(w, "shortestPathCalls", st->shortestPathCalls);
+    jsonFieldInt(w, "shortestPathSearches", st->shortestPathSearches);
+    jsonFieldInt(w, "batchRounds", sim->batchRounds);
+    jsonClose(w, '}');
+}
+
+// Live updates: GET /events is a Server-Sent Events stream. A new
+// subscriber gets the whole state once ("state"), then after each batch
+// of requests one "delta" with the system counters and only the units,
+// hospitals and calls that changed (calls that left the system come as
+// status "closed"). The event is serialized once and copied to every
+// subscriber; one that falls HTTP_MAX_BACKLOG behind is dropped and
+// resyncs on reconnect.
+HttpConn** subscribers = NULL;
+int subscriberCount = 0, subscriberCap = 0;
+JsonWriter eventBuffer;
+int lastPushedTime = -1;
+int resyncSubscribers = 0;
+
+void jsonFullState(JsonWriter* w) {
+    jsonOpen(w, '{');
+    jsonKey(w, "system");
+    jsonSystemState(w);
+    jsonKey(w, "ambulances");
+    jsonOpen(w, '[');
+    for(int i = 0; i < sim->ambulanceCount; i++) jsonAmbulance(w, i);
+    jsonClose(w, ']');
+    jsonKey(w, "hospitals");
+    jsonOpen(w, '[');
+    for(int h = 0; h < sim->hospitalCount; h++) jsonHospital(w, h);
+    jsonClose(w, ']');
+    jsonKey(w, "pending");
+    jsonOpen(w, '[');
+    for(int i = 0; i < sim->queueSize; i++) jsonEmergency(w, pendingAt(i), "pending");
+    jsonClose(w, ']');
+    jsonKey(w, "active");
+    jsonOpen(w, '[');
+    for(int i = 0; i < sim->activeCount; i++) jsonEmergency(w, activeAt(i), "active");
+    jsonClose(w, ']');
+    jsonClose(w, '}');
+}
+
+void jsonDelta(JsonWriter* w) {
+    jsonOpen(w, '{');
+    jsonKey(w, "system");
+    jsonSystemState(w);
+    jsonKey(w, "ambulances");
+    jsonOpen(w, '[');
+    for(int k = 0; k < sim->changedUnits.count; k++) jsonAmbulance(w, sim->changedUnits.items[k]);
+    jsonClose(w, ']');
+    jsonKey(w, "hospitals");
+    jsonOpen(w, '[');
+    for(int k = 0; k < sim->changedHospitals.count; k++) jsonHospital(w, sim->changedHospitals.items[k]);
+    jsonClose(w, ']');
+    jsonKey(w, "emergencies");
+    jsonOpen(w, '[');
+    for(int k = 0; k < sim->changedEmergencies.count; k++) {
+        int id = sim->changedEmergencies.items[k];
+        const char* status;
+        const Emergency* e = lookupEmergency(id, &status);
+        if(e) jsonEmergency(w, e, status);
+        else {
+            jsonOpen(w, '{');
+            jsonFieldInt(w, "emergencyId", id);
+            jsonFieldString(w, "status", "closed");
+            jsonClose(w, '}');
+        }
+    }
+    jsonClose(w, ']');
+    jsonClose(w, '}');
+}
+
+// One SSE event: whole state or the changes since the last push
+void sseEvent(JsonWriter* w, int full) {
+    if(full) jsonRaw(w, "event: state\ndata: ", 19);
+    else jsonRaw(w, "event: delta\ndata: ", 19);
+    w->first = 1;
+    if(full) jsonFullState(w);
+    else jsonDelta(w);
+    jsonRaw(w, "\n\n", 2);
+}
+
+void httpSubscribe(HttpConn* c) {
+    const char* headers =
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: text/event-stream\r\n"
+        "Cache-Control: no-cache\r\n"
+        "Access-Control-Allow-Origin: *\r\n"
+        "Connection: keep-alive\r\n\r\n";
+    jsonRaw(&c->out, headers, strlen(headers));
+    sseEvent(&c->out, 1);
+    // The stream stays open until the client goes away
+    c->closeAfter = 0;
     
-    for(int i = 0; i < hospitalCount; i++) {
-        printf("  %s - %s\n", hospitals[i].name, locations[hospitals[i].location].name);
-        printf("    Beds: %d/%d\n\n", hospitals[i].patients, hospitals[i].capacity);
+    subscribers = reserveArray(subscribers, &subscriberCap, subscriberCount + 1, sizeof(HttpConn*));
+    subscribers[subscriberCount++] = c;
+    c->subscriber = subscriberCount;
+}
+
+void httpUnsubscribe(HttpConn* c) {
+    if(!c->subscriber) return;
+    HttpConn* last = subscribers[--subscriberCount];
+    subscribers[c->subscriber - 1] = last;
+    last->subscriber = c->subscriber;
+    c->subscriber = 0;
+}
+
+// Integer / string member `key` of a flat JSON request body. Good enough
+// for the dashboard's bodies; not a general parser.
+const char* jsonMember(const char* body, const char* key) {
+    size_t keyLen = strlen(key);
+    for(const char* p = strchr(body, '"'); p; p = strchr(p + 1, '"')) {
+        if(strncmp(p + 1, key, keyLen) != 0 || p[keyLen + 1] != '"') continue;
+        p += keyLen + 2;
+        while(*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') p++;
+        if(*p != ':') continue;
+        p++;
+        while(*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') p++;
+        return p;
     }
+    return NULL;
 }
 
-void viewPendingEmergencies() {
-    printf("\nPENDING EMERGENCIES QUEUE\n");
-    printf("\n\n");
+int jsonMemberInt(const char* body, const char* key, int fallback) {
+    const char* p = jsonMember(body, key);
+    char* end;
+    long v = p ? strtol(p, &end, 10) : 0;
+    return p && end != p && v >= INT_MIN && v <= INT_MAX ? (int)v : fallback;
+}
+
+// Four hex digits of a \u escape, or -1
+int jsonHex4(const char* p) {
+    int v = 0;
+    for(int i = 0; i < 4; i++) {
+        int c = p[i];
+        int d = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 :
+                c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+        if(d < 0) return -1;
+        v = v * 16 + d;
+    }
+    return v;
+}
+
+// Decodes string member `key` into out as UTF-8, cut at a whole
+// character if it does not fit. Missing or non-string members give the
+// fallback; returns 0 on a malformed escape (or \u0000).
+int jsonMemberString(const char* body, const char* key, char* out, int size, const char* fallback) {
+    const char* p = jsonMember(body, key);
+    snprintf(out, size, "%s", fallback);
+    if(!p || *p != '"') return 1;
     
-    if(queueSize == 0) {
-        printf("  No pending emergencies.\n\n");
-    } else {
-        for(int i = 0; i < queueSize; i++) {
-            printf("  #%d: %s\n", pendingQueue[i].id, pendingQueue[i].caller);
-            printf("      Location: %s\n", locations[pendingQueue[i].location].name);
-            printf("      Priority: %d\n", pendingQueue[i].priority);
-            printf("      Waiting: %d min\n\n", currentTime - pendingQueue[i].reportTime);
+    int n = 0, full = 0;
+    for(p++; *p && *p != '"'; p++) {
+        char bytes[4];
+        int len = 1;
+        bytes[0] = *p;
+        unsigned char lead = *p;
+        if(lead >= 0xC0) {
+            // Raw multi-byte character: moved as a unit
+            int want = lead >= 0xF0 ? 4 : lead >= 0xE0 ? 3 : 2;
+            while(len < want && ((unsigned char)p[1] & 0xC0) == 0x80) bytes[len++] = *++p;
+        }
+        else if(*p == '\\') {
+            p++;
+            switch(*p) {
+                case '"': case '\\': case '/': bytes[0] = *p; break;
+                case 'b': bytes[0] = '\b'; break;
+                case 'f': bytes[0] = '\f'; break;
+                case 'n': bytes[0] = '\n'; break;
+                case 'r': bytes[0] = '\r'; break;
+                case 't': bytes[0] = '\t'; break;
+                case 'u': {
+                    long code = jsonHex4(p + 1);
+                    if(code <= 0 || (code >= 0xDC00 && code <= 0xDFFF)) return 0;
+                    p += 4;
+                    // A high surrogate must be followed by a low one
+                    if(code >= 0xD800 && code <= 0xDBFF) {
+                        long low = p[1] == '\\' && p[2] == 'u' ? jsonHex4(p + 3) : -1;
+                        if(low < 0xDC00 || low > 0xDFFF) return 0;
+                        code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                        p += 6;
+                    }
+                    if(code < 0x80) bytes[0] = code;
+                    else if(code < 0x800) {
+                        bytes[0] = 0xC0 | (code >> 6);
+                        bytes[1] = 0x80 | (code & 0x3F);
+                        len = 2;
+                    }
+                    else if(code < 0x10000) {
+                        bytes[0] = 0xE0 | (code >> 12);
+                        bytes[1] = 0x80 | ((code >> 6) & 0x3F);
+                        bytes[2] = 0x80 | (code & 0x3F);
+                        len = 3;
+                    }
+                    else {
+                        bytes[0] = 0xF0 | (code >> 18);
+                        bytes[1] = 0x80 | ((code >> 12) & 0x3F);
+                        bytes[2] = 0x80 | ((code >> 6) & 0x3F);
+                        bytes[3] = 0x80 | (code & 0x3F);
+                        len = 4;
+                    }
+                    break;
+                }
+                default: return 0;
+            }
         }
+        // Keep scanning after the buffer fills, so later escapes are still checked
+        if(full || n + len > size - 1) {
+            full = 1;
+            continue;
+        }
+        memcpy(out + n, bytes, len);
+        n += len;
     }
+    if(*p != '"') return 0;
+    out[n] = '\0';
+    return 1;
 }
 
-void viewMapAndLocations() {
-    printf("\nMAP & LOCATIONS\n");
-    printf("\n\n");
-    
-    printf("  Locations:\n");
-    for(int i = 0; i < MAX_LOCATIONS; i++) {
-        printf("  %d. %s (x=%d, y=%d)\n", 
-               i, locations[i].name, locations[i].x, locations[i].y);
+// Starts a response; its Content-Length is filled in by httpEnd
+size_t httpBegin(HttpConn* c, int status) {
+    const char* reason = status == 200 ? "OK" : status == 201 ? "Created" : status == 204 ? "No Content" :
+                         status == 400 ? "Bad Request" : status == 404 ? "Not Found" :
+                         status == 405 ? "Method Not Allowed" : "Payload Too Large";
+    char line[64];
+    int n = snprintf(line, sizeof(line), "HTTP/1.1 %d %s\r\n", status, reason);
+    JsonWriter* w = &c->out;
+    jsonRaw(w, line, n);
+    const char* headers =
+        "Content-Type: application/json\r\n"
+        "Access-Control-Allow-Origin: *\r\n"
+        "Access-Control-Allow-Methods: GET, POST, OPTIONS\r\n"
+        "Access-Control-Allow-Headers: Content-Type\r\n";
+    jsonRaw(w, headers, strlen(headers));
+    if(c->closeAfter) jsonRaw(w, "Connection: close\r\n", 19);
+    else jsonRaw(w, "Connection: keep-alive\r\n", 24);
+    jsonRaw(w, "Content-Length:           \r\n\r\n", 30);
+    w->first = 1;
+    return w->len;
+}
+
+// Right-aligns the body length in the blank Content-Length field
+void httpEnd(HttpConn* c, size_t bodyStart) {
+    JsonWriter* w = &c->out;
+    size_t length = w->len - bodyStart;
+    char* field = w->data + bodyStart - 4 - 10;
+    for(int k = 9; k >= 0; k--) {
+        field[k] = length > 0 || k == 9 ? '0' + length % 10 : ' ';
+        length /= 10;
+    }
+}
+
+void httpError(HttpConn* c, int status, const char* message) {
+    size_t body = httpBegin(c, status);
+    if(status != 204) {
+        jsonOpen(&c->out, '{');
+        jsonFieldString(&c->out, "error", message);
+        jsonClose(&c->out, '}');
+    }
+    httpEnd(c, body);
+}
+
+// Trailing /<id> of path after prefix, or -1
+int pathId(const char* path, const char* prefix) {
+    size_t n = strlen(prefix);
+    if(strncmp(path, prefix, n) != 0 || path[n] != '/' || !path[n + 1]) return -1;
+    char* end;
+    long id = strtol(path + n + 1, &end, 10);
+    return *end == '\0' && id >= 0 && id <= INT_MAX ? (int)id : -1;
+}
+
+void serverReset(const char* scenario, const char* restore);
+
+void httpRoute(HttpConn* c, const char* method, const char* path, const char* body,
+               const char* scenario, const char* restore) {
+    JsonWriter* w = &c->out;
+    int get = strcmp(method, "GET") == 0, post = strcmp(method, "POST") == 0;
+    if(strcmp(method, "OPTIONS") == 0) {
+        httpError(c, 204, "");
+        return;
     }
+    if(strncmp(path, "/api/", 5) == 0) path += 4;
+    int id;
+    size_t start;
     
-    printf("\n  Road Connections:\n");
-    for(int i = 0; i < MAX_LOCATIONS; i++) {
-        printf("  %s: ", locations[i].name);
-        Road* r = roads[i];
-        int first = 1;
-        while(r != NULL) {
-            if(!first) printf(", ");
-            printf("%s (%dkm)", locations[r->destination].name, r->distance);
-            first = 0;
-            r = r->next;
+    if(get && strcmp(path, "/events") == 0) {
+        httpSubscribe(c);
+        return;
+    }
+    else if(get && strcmp(path, "/health") == 0) {
+        start = httpBegin(c, 200);
+        jsonOpen(w, '{');
+        jsonFieldString(w, "status", "ok");
+        jsonFieldInt(w, "currentTime", sim->currentTime);
+        jsonClose(w, '}');
+    }
+    else if(get && strcmp(path, "/system/state") == 0) {
+        start = httpBegin(c, 200);
+        jsonSystemState(w);
+    }
+    else if(post && strcmp(path, "/system/advance-time") == 0) {
+        int minutes = jsonMemberInt(body, "minutes", 1);
+        if(minutes < 0 || minutes > 7 * 24 * 60) {
+            httpError(c, 400, "minutes must be 0-10080");
+            return;
         }
-        printf("\n");
+        advanceTime(minutes);
+        start = httpBegin(c, 200);
+        jsonSystemState(w);
     }
-    printf("\n");
+    else if(post && strcmp(path, "/system/reset") == 0) {
+        serverReset(scenario, restore);
+        start = httpBegin(c, 200);
+        jsonSystemState(w);
+    }
+    else if(get && strcmp(path, "/stats") == 0) {
+        start = httpBegin(c, 200);
+        jsonStats(w);
+    }
+    else if(post && strcmp(path, "/emergencies") == 0) {
+        char caller[JOURNAL_CALLER_SIZE];
+        if(!jsonMemberString(body, "caller", caller, sizeof(caller), "Caller")) {
+            httpError(c, 400, "bad escape in caller");
+            return;
+        }
+        int loc = jsonMemberInt(body, "location", -1);
+        int disease = jsonMemberInt(body, "disease", GENERAL);
+        int age = jsonMemberInt(body, "age", -1);
+        if(loc < 0 || loc >= sim->locationCount || disease < GENERAL || disease > CARDIAC || age < 0 || age > 150) {
+            httpError(c, 400, "need location, disease 1-5 and age");
+            return;
+        }
+        
+        // As the console does: report the call, then let two minutes pass.
+        // The call may be dispatched, or even done, by the time we answer.
+        enqueueEmergency(caller, loc, (DiseaseType)disease, age);
+        int newId = sim->nextEmergencyId - 1;
+        Emergency reported = sim->pendingRecords[idMapGet(&sim->pendingIndex, newId)];
+        advanceTime(2);
+        const char* status;
+        const Emergency* e = lookupEmergency(newId, &status);
+        if(!e) {
+            e = &reported;
+            status = "closed";
+        }
+        start = httpBegin(c, 201);
+        jsonEmergency(w, e, status);
+    }
+    else if(get && strcmp(path, "/emergencies/pending") == 0) {
+        start = httpBegin(c, 200);
+        jsonOpen(w, '[');
+        for(int i = 0; i < sim->queueSize; i++) jsonEmergency(w, pendingAt(i), "pending");
+        jsonClose(w, ']');
+    }
+    else if(get && strcmp(path, "/emergencies/active") == 0) {
+        start = httpBegin(c, 200);
+        jsonOpen(w, '[');
+        for(int i = 0; i < sim->activeCount; i++) jsonEmergency(w, activeAt(i), "active");
+        jsonClose(w, ']');
+    }
+    else if(get && (id = pathId(path, "/emergencies")) >= 0) {
+        const char* status;
+        const Emergency* e = lookupEmergency(id, &status);
+        if(!e) {
+            httpError(c, 404, "no such emergency");
+            return;
+        }
+        start = httpBegin(c, 200);
+        jsonEmergency(w, e, status);
+    }
+    else if(get && strcmp(path, "/ambulances") == 0) {
+        start = httpBegin(c, 200);
+        jsonOpen(w, '[');
+        for(int i = 0; i < sim->ambulanceCount; i++) jsonAmbulance(w, i);
+        jsonClose(w, ']');
+    }
+    else if(get && strcmp(path, "/ambulances/idle") == 0) {
+        int idle = collectUnitsInState(IDLE, sim->idleUnits, sim->ambulanceCount);
+        start = httpBegin(c, 200);
+        jsonOpen(w, '[');
+        for(int k = 0; k < idle; k++) jsonAmbulance(w, sim->idleUnits[k]);
+        jsonClose(w, ']');
+    }
+    else if(get && (id = pathId(path, "/ambulances")) >= 0) {
+        if(id < 1 || id > sim->ambulanceCount) {
+            httpError(c, 404, "no such ambulance");
+            return;
+        }
+        start = httpBegin(c, 200);
+        jsonAmbulance(w, id - 1);
+    }
+    else if(get && strcmp(path, "/hospitals") == 0) {
+        start = httpBegin(c, 200);
+        jsonOpen(w, '[');
+        for(int h = 0; h < sim->hospitalCount; h++) jsonHospital(w, h);
+        jsonClose(w, ']');
+    }
+    else if(get && strcmp(path, "/hospitals/available") == 0) {
+        start = httpBegin(c, 200);
+        jsonOpen(w, '[');
+        for(int h = 0; h < sim->hospitalCount; h++)
+            if(sim->hospitals[h].patients < sim->hospitals[h].capacity) jsonHospital(w, h);
+        jsonClose(w, ']');
+    }
+    else if(get && (id = pathId(path, "/hospitals")) >= 0) {
+        if(id >= sim->hospitalCount) {
+            httpError(c, 404, "no such hospital");
+            return;
+        }
+        start = httpBegin(c, 200);
+        jsonHospital(w, id);
+    }
+    else {
+        httpError(c, get || post ? 404 : 405, get || post ? "not found" : "method not allowed");
+        return;
+    }
+    httpEnd(c, start);
 }
 
-void viewStatistics() {
-    printf("\nSYSTEM STATISTICS\n");
-    printf("\n\n");
+// Case-insensitive header lookup in the header block [head, end)
+const char* httpHeader(const char* head, const char* end, const char* name) {
+    size_t n = strlen(name);
+    for(const char* p = head; p < end; ) {
+        const char* eol = memchr(p, '\n', end - p);
+        if(!eol) break;
+        if((size_t)(eol - p) > n && strncasecmp(p, name, n) == 0 && p[n] == ':') {
+            p += n + 1;
+            while(*p == ' ' || *p == '\t') p++;
+            return p;
+        }
+        p = eol + 1;
+    }
+    return NULL;
+}
+
+// Answers every complete request in the input buffer, in order. Returns
+// 0 if the connection should be dropped at once.
+int httpProcess(HttpConn* c, const char* scenario, const char* restore) {
+    while(!c->closeAfter) {
+        // An event stream has nothing more to answer
+        if(c->subscriber) {
+            c->inLen = 0;
+            return 1;
+        }
+        if(c->inLen == 0) return 1;
+        c->in[c->inLen] = '\0';
+        char* end = strstr(c->in, "\r\n\r\n");
+        if(!end) return c->inLen < HTTP_MAX_REQUEST;
+        
+        *end = '\0';
+        const char* length = httpHeader(c->in, end + 2, "Content-Length");
+        long bodyLen = length ? strtol(length, NULL, 10) : 0;
+        int headLen = end + 4 - c->in;
+        if(bodyLen < 0 || headLen + bodyLen >= HTTP_MAX_REQUEST) {
+            c->closeAfter = 1;
+            httpError(c, 413, "request too large");
+            return 1;
+        }
+        if(c->inLen < headLen + bodyLen) {
+            *end = '\r';
+            return 1;
+        }
+        
+        char method[16], path[256], version[16];
+        if(sscanf(c->in, "%15s %255s %15s", method, path, version) != 3) {
+            c->closeAfter = 1;
+            httpError(c, 400, "bad request line");
+            return 1;
+        }
+        char* query = strchr(path, '?');
+        if(query) *query = '\0';
+        
+        const char* connection = httpHeader(c->in, end + 2, "Connection");
+        if(strcmp(version, "HTTP/1.1") != 0) c->closeAfter = !connection || strncasecmp(connection, "keep-alive", 10) != 0;
+        else if(connection && strncasecmp(connection, "close", 5) == 0) c->closeAfter = 1;
+        
+        // Body as a string, in place of the first byte of the next request
+        char saved = c->in[headLen + bodyLen];
+        c->in[headLen + bodyLen] = '\0';
+        httpRoute(c, method, path, c->in + headLen, scenario, restore);
+        c->in[headLen + bodyLen] = saved;
+        
+        c->inLen -= headLen + bodyLen;
+        memmove(c->in, c->in + headLen + bodyLen, c->inLen);
+    }
+    return 1;
+}
+
+// Sends what the socket takes; returns 0 on a dead connection
+int httpSend(HttpConn* c) {
+    while(c->outSent < c->out.len) {
+        ssize_t n = send(c->fd, c->out.data + c->outSent, c->out.len - c->outSent, MSG_NOSIGNAL);
+        if(n < 0) return errno == EAGAIN || errno == EWOULDBLOCK;
+        c->outSent += n;
+    }
+    c->out.len = c->outSent = 0;
+    return 1;
+}
+
+void httpCloseConn(int epoll, HttpConn* c) {
+    httpUnsubscribe(c);
+    epoll_ctl(epoll, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    free(c->in);
+    free(c->out.data);
+    free(c);
+}
+
+// Asks for a write wakeup only while output is queued
+void httpWatch(int epoll, HttpConn* c) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN | (c->out.len > 0 ? EPOLLOUT : 0);
+    ev.data.ptr = c;
+    epoll_ctl(epoll, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+// Reads, answers and writes whatever a ready connection has
+void httpService(int epoll, HttpConn* c, unsigned events, const char* scenario, const char* restore) {
+    int alive = !(events & (EPOLLERR | EPOLLHUP));
+    while(alive && (events & EPOLLIN) && c->inLen < HTTP_MAX_REQUEST) {
+        if(c->inLen + 1 >= c->inCap) {
+            c->inCap = c->inCap ? c->inCap * 2 : 4096;
+            c->in = realloc(c->in, c->inCap);
+            if(!c->in) {
+                fprintf(stderr, "Out of memory\n");
+                exit(1);
+            }
+        }
+        ssize_t n = recv(c->fd, c->in + c->inLen, c->inCap - c->inLen - 1, 0);
+        if(n > 0) c->inLen += n;
+        else {
+            if(n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) alive = 0;
+            break;
+        }
+    }
+    if(alive) alive = httpProcess(c, scenario, restore);
+    if(alive) alive = httpSend(c);
+    if(!alive || (c->closeAfter && c->out.len == 0)) {
+        httpCloseConn(epoll, c);
+        return;
+    }
+    httpWatch(epoll, c);
+}
+
+// Sends this tick's changes to every subscriber and starts a new tick
+void pushChanges(int epoll) {
+    int changed = sim->changedUnits.count > 0 || sim->changedHospitals.count > 0 ||
+                  sim->changedEmergencies.count > 0 || sim->currentTime != lastPushedTime;
+    if(subscriberCount > 0 && (changed || resyncSubscribers)) {
+        eventBuffer.len = 0;
+        sseEvent(&eventBuffer, resyncSubscribers);
+        for(int k = subscriberCount - 1; k >= 0; k--) {
+            HttpConn* c = subscribers[k];
+            jsonRaw(&c->out, eventBuffer.data, eventBuffer.len);
+            if(!httpSend(c) || c->out.len - c->outSent > HTTP_MAX_BACKLOG) httpCloseConn(epoll, c);
+            else httpWatch(epoll, c);
+        }
+    }
     
-    printf("  Current Time: %d minutes\n", currentTime);
-    printf("  Total Emergencies Handled: %d\n", totalHandled);
-    printf("  Active Emergencies: %d\n", activeCount);
-    printf("  Pending Emergencies: %d\n", queueSize);
+    clearChanges(&sim->changedUnits);
+    clearChanges(&sim->changedHospitals);
+    clearChanges(&sim->changedEmergencies);
+    lastPushedTime = sim->currentTime;
+    resyncSubscribers = 0;
+}
+
+void serverSignal(int sig) {
+    (void)sig;
+    serverStop = 1;
+}
+
+// Puts the run back to its starting state; the journal starts over
+void serverReset(const char* scenario, const char* restore) {
+    resetSystem();
+    setupBaseState(scenario, restore);
+    journalRestart();
+    resyncSubscribers = 1;
+}
+
+// Serves the API on 127.0.0.1:port until SIGINT / SIGTERM
+int runServer(int port, const char* scenario, const char* restore, const char* journal, int verbose) {
+    if(!setupBaseState(scenario, restore)) return 1;
+    if(journal && !journalOpen(journal)) {
+        fprintf(stderr, "Cannot write journal %s\n", journal);
+        return 1;
+    }
+    sim->simLogEnabled = verbose;
+    sim->trackChanges = 1;
+    lastPushedTime = sim->currentTime;
     
-    if(totalHandled > 0) {
-        printf("  Average Response Time: %.1f minutes\n", 
-               (float)totalResponseTime / totalHandled);
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    if(listener < 0) {
+        fprintf(stderr, "Cannot open a socket: %s\n", strerror(errno));
+        journalClose();
+        return 1;
+    }
+    fcntl(listener, F_SETFL, O_NONBLOCK);
+    int one = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(bind(listener, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(listener, 128) != 0) {
+        fprintf(stderr, "Cannot listen on port %d: %s\n", port, strerror(errno));
+        close(listener);
+        journalClose();
+        return 1;
     }
     
-    int idleCount = 0;
-    for(int i = 0; i < MAX_AMBULANCES; i++) {
-        if(ambulances[i].state == IDLE) idleCount++;
+    int epoll = epoll_create1(0);
+    if(epoll < 0) {
+        fprintf(stderr, "Cannot create epoll instance: %s\n", strerror(errno));
+        close(listener);
+        journalClose();
+        return 1;
     }
-    printf("  Available Ambulances: %d/%d\n", idleCount, MAX_AMBULANCES);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(epoll, EPOLL_CTL_ADD, listener, &ev);
     
-    int totalBeds = 0, usedBeds = 0;
-    for(int i = 0; i < hospitalCount; i++) {
-        totalBeds += hospitals[i].capacity;
-        usedBeds += hospitals[i].patients;
+    signal(SIGINT, serverSignal);
+    signal(SIGTERM, serverSignal);
+    printf("Serving http://127.0.0.1:%d/api (minute %d, %d units, %d hospitals)\n",
+           port, sim->currentTime, sim->ambulanceCount, sim->hospitalCount);
+    fflush(stdout);
+    
+    struct epoll_event events[HTTP_MAX_EVENTS];
+    while(!serverStop) {
+        int n = epoll_wait(epoll, events, HTTP_MAX_EVENTS, -1);
+        for(int k = 0; k < n; k++) {
+            HttpConn* c = events[k].data.ptr;
+            if(c) {
+                httpService(epoll, c, events[k].events, scenario, restore);
+                continue;
+            }
+            
+            int fd;
+            while((fd = accept(listener, NULL, NULL)) >= 0) {
+                fcntl(fd, F_SETFL, O_NONBLOCK);
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                c = calloc(1, sizeof(HttpConn));
+                if(!c) {
+                    fprintf(stderr, "Out of memory\n");
+                    exit(1);
+                }
+                c->fd = fd;
+                ev.events = EPOLLIN;
+                ev.data.ptr = c;
+                epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &ev);
+            }
+        }
+        // Everything answered is also on disk, and out to subscribers
+        journalFlush();
+        pushChanges(epoll);
     }
-    printf("  Hospital Bed Usage: %d/%d\n\n", usedBeds, totalBeds);
+    
+    close(epoll);
+    close(listener);
+    free(subscribers);
+    free(eventBuffer.data);
+    journalClose();
+    logFlush();
+    printf("\nServer stopped at minute %d\n", sim->currentTime);
+    return 0;
 }
 
-void autoRunSimulation() {
-    printf("\n  Running simulation for 10 time steps...\n\n");
-    for(int i = 0; i < 10; i++) {
-        printf("  Step %d (Time: %d min)\n", i + 1, currentTime + 1);
-        advanceTime(1);
-    }
-    printf("\n  Simulation complete!\n\n");
-}
 
-void showMenu() {
-    printf("\nAMBULANCE DISPATCH MANAGEMENT SYSTEM\n\n");
-    printf("  1. Report New Emergency\n");
-    printf("  2. View System Status\n");
-    printf("  3. View Ambulance Status\n");
-    printf("  4. View Hospital Status\n");
-    printf("  5. View Pending Emergencies\n");
-    printf("  6. Advance Time (Step Simulation)\n");
-    printf("  7. Auto-Run Simulation (10 steps)\n");
-    printf("  8. View Map & Locations\n");
-    printf("  9. System Statistics\n");
-    printf("  0. Exit\n");
-    printf("------------------------------------\n");
-    printf("Current Time: %d minutes | Pending: %d | Active: %d\n\n", 
-           currentTime, queueSize, activeCount);
-    printf("  Choice: ");
+void printUsage(const char* prog) {
+    fprintf(stderr, "Usage: %s                      interactive console\n", prog);
+    fprintf(stderr, "       %s --scenario FILE [--verbose] [--batch] [--stats] [--seed N]\n"
+                    "              [--checkpoint FILE [--checkpoint-at MIN]] [--restore FILE]\n", prog);
+    fprintf(stderr, "       %s --restore FILE               interactive console from a snapshot\n", prog);
+    fprintf(stderr, "       %s --replay JOURNAL [--scenario FILE | --restore FILE] [--verbose]\n"
+                    "              [--stats] [--checkpoint FILE]\n", prog);
+    fprintf(stderr, "       %s --serve [--port N] [--scenario FILE | --restore FILE] [--journal FILE]\n"
+                    "              [--verbose]        JSON API and /events stream for the dashboard\n"
+                    "                                 (default port 3000)\n", prog);
+    fprintf(stderr, "  --journal FILE                   journal a scenario run or console session\n");
+    fprintf(stderr, "  --log-level error|warn|info|debug  simulation messages shown (default info)\n");
+    fprintf(stderr, "       %s --montecarlo FILE [--runs N] [--threads N] [--batch] [--seed N]\n", prog);
+    fprintf(stderr, "       %s --bench grid|geo [--nodes N] [--units N] [--hospitals N]\n"
+                    "              [--calls N] [--samples N] [--traffic] [--seed N]\n", prog);
+    fprintf(stderr, "  --routing dijkstra|astar|alt|ch  route search on large maps (default astar)\n");
+    fprintf(stderr, "  --ch-file FILE                   load/save the contraction hierarchy for ch\n");
 }
 
 
-int main() {
-    srand(time(NULL));
-    
+void setupDefaultSystem() {
+    reserveCapacity(10, 4, DEFAULT_AMBULANCES, 20);
     setupLocations();
     setupRoads();
     setupHospitals();
     setupAmbulances();
+}
+
+int main(int argc, char** argv) {
+    srand(time(NULL));
+    const char* restore = NULL;
+    const char* journal = NULL;
+    
+    if(argc > 1) {
+        const char* scenario = NULL;
+        const char* monteCarlo = NULL;
+        const char* bench = NULL;
+        const char* checkpoint = NULL;
+        const char* replay = NULL;
+        int serve = 0, port = HTTP_DEFAULT_PORT;
+        int checkpointAt = INT_MAX;
+        int nodes = 10000, units = 50, hospitalsWanted = 10, calls = 200, samples = 1000;
+        int verbose = 0, forceBatch = 0, stats = 0, traffic = 0, runs = 1000;
+        int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        unsigned long long seed = (unsigned long long)time(NULL);
+        
+        for(int i = 1; i < argc; i++) {
+            if(strcmp(argv[i], "--scenario") == 0 && i + 1 < argc) scenario = argv[++i];
+            else if(strcmp(argv[i], "--montecarlo") == 0 && i + 1 < argc) monteCarlo = argv[++i];
+            else if(strcmp(argv[i], "--runs") == 0 && i + 1 < argc) runs = atoi(argv[++i]);
+            else if(strcmp(argv[i], "--threads") == 0 && i + 1 < argc) threads = atoi(argv[++i]);
+            else if(strcmp(argv[i], "--seed") == 0 && i + 1 < argc) seed = strtoull(argv[++i], NULL, 10);
+            else if(strcmp(argv[i], "--bench") == 0 && i + 1 < argc) bench = argv[++i];
+            else if(strcmp(argv[i], "--nodes") == 0 && i + 1 < argc) nodes = atoi(argv[++i]);
+            else if(strcmp(argv[i], "--units") == 0 && i + 1 < argc) units = atoi(argv[++i]);
+            else if(strcmp(argv[i], "--hospitals") == 0 && i + 1 < argc) hospitalsWanted = atoi(argv[++i]);
+            else if(strcmp(argv[i], "--calls") == 0 && i + 1 < argc) calls = atoi(argv[++i]);
+            else if(strcmp(argv[i], "--samples") == 0 && i + 1 < argc) samples = atoi(argv[++i]);
+            else if(strcmp(argv[i], "--verbose") == 0) verbose = 1;
+            else if(strcmp(argv[i], "--batch") == 0) forceBatch = 1;
+            else if(strcmp(argv[i], "--stats") == 0) stats = 1;
+            else if(strcmp(argv[i], "--traffic") == 0) traffic = 1;
+            else if(strcmp(argv[i], "--routing") == 0 && i + 1 < argc && parseRouting(argv[i + 1]) >= 0)
+                defaultRouting = parseRouting(argv[++i]);
+            else if(strcmp(argv[i], "--ch-file") == 0 && i + 1 < argc) defaultChFile = argv[++i];
+            else if(strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc) checkpoint = argv[++i];
+            else if(strcmp(argv[i], "--checkpoint-at") == 0 && i + 1 < argc) checkpointAt = atoi(argv[++i]);
+            else if(strcmp(argv[i], "--restore") == 0 && i + 1 < argc) restore = argv[++i];
+            else if(strcmp(argv[i], "--journal") == 0 && i + 1 < argc) journal = argv[++i];
+            else if(strcmp(argv[i], "--replay") == 0 && i + 1 < argc) replay = argv[++i];
+            else if(strcmp(argv[i], "--serve") == 0) serve = 1;
+            else if(strcmp(argv[i], "--port") == 0 && i + 1 < argc) port = atoi(argv[++i]);
+            else if(strcmp(argv[i], "--log-level") == 0 && i + 1 < argc && parseLogLevel(argv[i + 1]) >= 0)
+                logLevel = parseLogLevel(argv[++i]);
+            else {
+                printUsage(argv[0]);
+                return 1;
+            }
+        }
+        
+        if(bench && nodes > 1 && units > 0 && hospitalsWanted > 0)
+            return runBenchmark(bench, nodes, units, hospitalsWanted, calls, samples, traffic, seed);
+        if(monteCarlo && runs > 0)
+            return runMonteCarlo(monteCarlo, runs, threads, seed, forceBatch);
+        logStart();
+        if(serve) {
+            sim = createSimContext(seed);
+            return runServer(port, scenario, restore, journal, verbose);
+        }
+        if(replay) {
+            sim = createSimContext(seed);
+            return runReplay(replay, scenario, restore, verbose, stats, checkpoint);
+        }
+        if(scenario) {
+            sim = createSimContext(seed);
+            return runHeadless(scenario, verbose, forceBatch, stats, restore, checkpoint, checkpointAt, journal);
+        }
+        if(!restore && !journal) {
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+    
+    logStart();
+    sim = createSimContext((unsigned long long)time(NULL));
+    if(restore) {
+        if(!loadSnapshot(restore)) {
+            fprintf(stderr, "Cannot restore %s\n", restore);
+            return 1;
+        }
+    }
+    else setupDefaultSystem();
+    if(journal && !journalOpen(journal)) {
+        fprintf(stderr, "Cannot write journal %s\n", journal);
+        return 1;
+    }
     
     printf("\nEMERGENCY DISPATCH SYSTEM INITIALIZED\n\n");
-    printf("  [+] %d ambulances\n", MAX_AMBULANCES);
-    printf("  [+] %d hospitals\n", hospitalCount);
+    printf("  [+] %d ambulances\n", sim->ambulanceCount);
+    printf("  [+] %d hospitals\n", sim->hospitalCount);
     printf("  [+] Dynamic reassignment enabled\n");
     printf("  [+] Priority queue active\n");
     printf("  [+] Dynamic service times enabled\n\n");
@@ -725,14 +6470,27 @@ int main() {
             case 7: autoRunSimulation(); break;
             case 8: viewMapAndLocations(); break;
             case 9: viewStatistics(); break;
+            case 10:
+                setBatchDispatch(!sim->batchDispatch);
+                printf("\n  Batch dispatch %s\n", sim->batchDispatch ? "enabled" : "disabled");
+                break;
+            case 11:
+                printf("\n");
+                printStatsSnapshot(stdout);
+                break;
+            case 12: toggleRoadClosure(); break;
+            case 13: saveCheckpoint(); break;
             case 0:
+                journalClose();
                 printf("\nSHIFT ENDED\n\n");
-                printf("  Total emergencies handled: %d\n\n", totalHandled);
+                printf("  Total emergencies handled: %d\n\n", sim->totalHandled);
                 return 0;
             default:
                 printf("\n  Invalid choice!\n");
         }
         
+        journalFlush();
+        logFlush();
         printf("\n  Press Enter to continue...");
         getchar(); getchar();
     }
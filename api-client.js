@@ -51,6 +51,15 @@ class AmbulanceAPI {
         });
     }
 
+    // Live updates: onState gets the whole state on (re)connect, onDelta
+    // only what changed since the previous event. Returns the EventSource.
+    subscribe(onState, onDelta) {
+        const source = new EventSource(`${this.baseURL}/events`);
+        source.addEventListener('state', event => onState(JSON.parse(event.data)));
+        source.addEventListener('delta', event => onDelta(JSON.parse(event.data)));
+        return source;
+    }
+
     // ============================================
     // EMERGENCY METHODS
     // ============================================
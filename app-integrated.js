@@ -5,6 +5,7 @@ const USE_BACKEND_API = true;
 const AUTO_SYNC_INTERVAL = 2000; // Sync every 2 seconds
 
 let syncInterval = null;
+let eventStream = null;
 
 // ==================== INITIALIZATION ====================
 
@@ -116,9 +117,16 @@ function getStateStringFromCode(stateCode) {
     return states[stateCode] || 'IDLE';
 }
 
-// Auto-sync with backend
+// Auto-sync with backend: pushed updates when the browser supports them,
+// polling otherwise
 function startAutoSync() {
     if (syncInterval) clearInterval(syncInterval);
+    if (eventStream) eventStream.close();
+
+    if (typeof EventSource !== 'undefined') {
+        eventStream = api.subscribe(applyFullState, applyDelta);
+        return;
+    }
 
     syncInterval = setInterval(async () => {
         if (USE_BACKEND_API) {
@@ -163,6 +171,79 @@ async function syncWithBackend() {
     updateUI();
 }
 
+function toEmergency(e) {
+    return {
+        id: e.emergencyId,
+        caller: e.caller,
+        location: e.location,
+        disease: e.disease,
+        age: e.age,
+        priority: e.priority,
+        assignedAmbulance: e.assignedAmbulance,
+        canReassign: e.canReassign,
+        reportTime: e.reportTime,
+        serviceTime: e.serviceTime
+    };
+}
+
+function applySystemState(state) {
+    currentTime = state.currentTime;
+    nextEmergencyId = state.nextEmergencyId;
+    totalHandled = state.totalHandled;
+    totalResponseTime = state.totalResponseTime;
+}
+
+function applyHospital(h) {
+    hospitals[h.hospitalId] = {
+        name: h.name,
+        location: h.location,
+        capacity: h.capacity,
+        patients: h.currentPatients,
+        specialty: h.specialty
+    };
+}
+
+function applyAmbulance(a) {
+    ambulances[a.ambulanceId - 1] = {
+        id: a.ambulanceId,
+        state: getStateCodeFromString(a.state),
+        location: a.location,
+        availableAt: a.availableAt,
+        targetEmergency: a.targetEmergency,
+        targetHospital: a.targetHospital,
+        estimatedArrival: a.estimatedArrival,
+        baseHospital: a.baseHospital
+    };
+}
+
+// Sent once per connection (and after a reset): replaces everything
+function applyFullState(full) {
+    applySystemState(full.system);
+    hospitals = [];
+    full.hospitals.forEach(applyHospital);
+    ambulances = [];
+    full.ambulances.forEach(applyAmbulance);
+    pendingQueue = full.pending.map(toEmergency);
+    activeEmergencies = full.active.map(toEmergency);
+    updateUI();
+}
+
+// Only the units, hospitals and calls that changed; a call that left the
+// system arrives with status "closed"
+function applyDelta(delta) {
+    applySystemState(delta.system);
+    delta.hospitals.forEach(applyHospital);
+    delta.ambulances.forEach(applyAmbulance);
+
+    delta.emergencies.forEach(e => {
+        pendingQueue = pendingQueue.filter(p => p.id !== e.emergencyId);
+        activeEmergencies = activeEmergencies.filter(a => a.id !== e.emergencyId);
+        if (e.status === 'pending') pendingQueue.push(toEmergency(e));
+        else if (e.status === 'active') activeEmergencies.push(toEmergency(e));
+    });
+    updateUI();
+}
+
 // ==================== MODIFIED FUNCTIONS ====================
 
 // Modified emergency submission to use backend
@@ -176,7 +257,7 @@ async function handleEmergencySubmit() {
         try {
             await api.createEmergency({ caller: name, location, disease, age });
             showNotification(`Emergency created for ${name}`, 'success');
-            await syncWithBackend();
+            if (!eventStream) await syncWithBackend();
         } catch (error) {
             showNotification('Failed to create emergency', 'error');
             console.error(error);
@@ -194,7 +275,7 @@ async function advanceTimeWrapper(minutes = 1) {
     if (USE_BACKEND_API) {
         try {
             await api.advanceTime(minutes);
-            await syncWithBackend();
+            if (!eventStream) await syncWithBackend();
         } catch (error) {
             showNotification('Backend not available, using local mode', 'warning');
             advanceTime(minutes);